@@ -27,15 +27,41 @@ DMA:
 */
 
 #include <linux/cdev.h> /* cdev_ */
+#include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <linux/eventfd.h>
 #include <linux/fs.h>
+#include <linux/idr.h>
+#include <linux/highmem.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
+#include <linux/io.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/mm.h>
+#include <linux/mman.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/pci.h>
-#include <linux/pfn_t.h>
+#include <linux/poll.h>
+#include <linux/scatterlist.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
+
+#include "vta_ioctl.h"
 
 /* https://stackoverflow.com/questions/30190050/what-is-base-address-register-bar-in-pcie/44716618#44716618
  *
@@ -71,299 +97,3612 @@ DMA:
 #define IO_IRQ_STATUS 0x24
 #define QEMU_VENDOR_ID 0x1234
 
-#define VTA_CONTROL_PAGE	16
-#define VTA_CONTROL_SIZE	(VTA_CONTROL_PAGE >> PAGE_OFFSET)
-#define VTA_DEV_MEM			((256 * 1024 * 1024) - VTA_CONTROL_SIZE)
-
-#define IOCTL_TVM_VTA_CMD_EXEC        1
-
-typedef struct {
-	union {
-		struct {
-			u32 insn_phy_addr;
-			u32 insn_count;
-			u32 wait_cycles;
-			u32 status;
-		};
-		u32 data[4];
-	};
-} vta_exec_t;
-
 static struct pci_device_id pci_ids[] = {
 	{ PCI_DEVICE(QEMU_VENDOR_ID, VTA_DEVICE_ID), },
 	{ 0, }
 };
 MODULE_DEVICE_TABLE(pci, pci_ids);
 
-static int pci_irq;
 static int major;
-static struct pci_dev *pdev;
 struct class* cdevice_class;
-struct device* cdevice;
-static void __iomem *mmio;
-static void __iomem *ctrl_mmio;
-unsigned long pfn_dev_mem;
 
-volatile int *dram_used;
-int total_slice;
-#define DRAM_PAGE_PER_SLICE 32768
+/* One tvm-vta-N node per probed device, minor N. The tvm-vta node (minor
+ * VTA_ANY_MINOR) places each open on the least loaded device instead. */
+#define VTA_MAX_DEVS 16
+#define VTA_ANY_MINOR VTA_MAX_DEVS
+
+/* A slice is one control-register block of the device: the unit that
+ * runs an instruction stream. Device DRAM is handed out separately, see
+ * the buddy allocator below. The device does not say how many blocks it
+ * has, so by default there are as many as it always had, one per 128 MiB
+ * of DRAM; nr_slices is for devices known to have more.
+ *
+ * Tenants per device are bounded by the slice count, not by DRAM, so the
+ * allocator alone does not raise density. In the packed layout the irq
+ * registers leave room for at most IO_IRQ_ACK / block size blocks, and
+ * slice 1 already spans IO_IRQ_STATUS as on the original device; more
+ * tenants need a device with paged control blocks, see ctrl_paged. */
+static unsigned int nr_slices;
+module_param(nr_slices, uint, 0444);
+MODULE_PARM_DESC(nr_slices, "Number of control-register blocks exposed by the device, 0 for one per 128 MiB of dram");
+#define VTA_DRAM_PER_SLICE (128UL << 20)
+
+/* Control block words: insn address, insn count, wait cycles, dram base,
+ * status. 64-bit devices append the high halves of both addresses. */
+#define VTA_SLICE_CTRL_SIZE (sizeof(u32) * 5)
+#define VTA_SLICE_CTRL_SIZE64 (sizeof(u32) * 8)
+#define VTA_MAX_SLICES 32 /* one bit each in IO_IRQ_ACK */
+#define VTA_CLOSE_WAIT_MS 10000 /* for a slice that cannot be stopped */
+
+static bool addr64;
+module_param(addr64, bool, 0444);
+MODULE_PARM_DESC(addr64, "Device takes 64-bit addresses: 8-word control blocks and a 64-bit DMA mask");
+
+/* Devices built with two pages per control block, starting with the page
+ * after the one holding IO_IRQ_STATUS and IO_IRQ_ACK, can hand each slice's
+ * first page to its owner, see VTA_MMAP_CONTROL_OFFSET. The dram base
+ * words sit at their usual offsets on the second page, which only the
+ * kernel maps, so the owner rings the doorbell against the base the
+ * kernel programmed and stays inside its own dram like any other exec. */
+static bool ctrl_paged;
+module_param(ctrl_paged, bool, 0444);
+MODULE_PARM_DESC(ctrl_paged, "Slice control blocks take two pages each after the irq page, the first of which slice owners can map");
+
+/* Devices with a cycle counter report the cycles the last exec of a
+ * slice took in control word VTA_CTRL_CYCLES, which needs the 8-word
+ * block layout. */
+static bool cycle_counter;
+module_param(cycle_counter, bool, 0444);
+MODULE_PARM_DESC(cycle_counter, "Device reports exec cycles in an 8-word control block");
+
+/* Device DRAM allocator.
+ *
+ * A binary buddy tree over BAR_RAM in page units, the same scheme as
+ * user/buddy.h: node i covers a power-of-two range and longest[i] holds
+ * (order + 1) of the largest free block below it, 0 if none. Blocks are
+ * aligned to their size. */
+typedef struct {
+	struct mutex lock;
+	u8 *longest;
+	unsigned int max_order;
+	unsigned long free_pages;
+	unsigned int regions;
+} vta_buddy_t;
+
+static inline unsigned int buddy_node_order(unsigned long idx, unsigned int max_order) {
+	return max_order - (fls_long(idx + 1) - 1);
+}
+
+static int buddy_init(vta_buddy_t *b, unsigned long pages) {
+	unsigned long nodes, idx;
+
+	if (!pages)
+		return -EINVAL;
+	b->max_order = ilog2(pages);
+	nodes = (2UL << b->max_order) - 1;
+	b->longest = vzalloc(nodes);
+	if (!b->longest)
+		return -ENOMEM;
+	for (idx = 0; idx < nodes; idx++)
+		b->longest[idx] = buddy_node_order(idx, b->max_order) + 1;
+	b->free_pages = 1UL << b->max_order;
+	b->regions = 0;
+	mutex_init(&b->lock);
+	return 0;
+}
+
+static void buddy_destroy(vta_buddy_t *b) {
+	vfree(b->longest);
+	b->longest = NULL;
+}
+
+static void buddy_update_parents(vta_buddy_t *b, unsigned long idx) {
+	unsigned int order, l, r;
+
+	while (idx) {
+		idx = (idx - 1) / 2;
+		order = buddy_node_order(idx, b->max_order);
+		l = b->longest[2 * idx + 1];
+		r = b->longest[2 * idx + 2];
+		/* Both halves free means this whole block is free again. */
+		b->longest[idx] = (l == order && r == order) ? order + 1 : max(l, r);
+	}
+}
+
+/* Returns the page offset of a free block of 2^order pages, or -1. */
+static long buddy_alloc(vta_buddy_t *b, unsigned int order) {
+	unsigned long idx = 0;
+	unsigned int node_order = b->max_order;
+	long offset = -1;
+
+	mutex_lock(&b->lock);
+	if (order > b->max_order || b->longest[0] < order + 1)
+		goto out;
+	while (node_order != order) {
+		idx = 2 * idx + 1;
+		if (b->longest[idx] < order + 1)
+			idx++;
+		node_order--;
+	}
+	b->longest[idx] = 0;
+	buddy_update_parents(b, idx);
+	offset = (idx + 1 - (1UL << (b->max_order - order))) << order;
+	b->free_pages -= 1UL << order;
+	b->regions++;
+out:
+	mutex_unlock(&b->lock);
+	return offset;
+}
+
+static void buddy_free(vta_buddy_t *b, unsigned long offset, unsigned int order) {
+	unsigned long idx = (offset >> order) + (1UL << (b->max_order - order)) - 1;
+
+	mutex_lock(&b->lock);
+	b->longest[idx] = order + 1;
+	buddy_update_parents(b, idx);
+	b->free_pages += 1UL << order;
+	b->regions--;
+	mutex_unlock(&b->lock);
+}
+
+/* A device DRAM region of an open file, one per mmap offset.
+ *
+ * User space tells regions apart by the offset it passes to mmap(), so it
+ * can keep weights resident while it unmaps and remaps activation buffers.
+ * maps counts the vmas backed by the region; the last munmap frees it. */
+typedef struct {
+	struct list_head node;
+	unsigned long pgoff;
+	u64 dram_base;
+	unsigned long pfn;
+	int order;
+	int maps;
+	u32 flags; /* VTA_MAP_* at creation */
+	void *shadow; /* host copy mapped instead, with VTA_MAP_CACHED */
+} vta_region_t;
+
+/* What a completed exec left behind, see vta_exec_times_t. */
+typedef struct {
+	u32 status;
+	u32 cycles;
+	u64 submit_ns;
+	u64 start_ns;
+	u64 done_ns;
+} vta_exec_rec_t;
+
+typedef struct vta_user {
+	struct vta_dev *dev;
+	int slice_idx;
+	void __iomem *ctrl_mmio;
+
+	/* Regions by mmap offset, protected by lock. Execs run against the
+	 * base region: exec_base is its byte offset into BAR_RAM, copied under
+	 * the slice lock so the completion path can start execs. */
+	struct mutex lock;
+	struct list_head regions;
+	u32 map_flags;
+	/* Regions unmapped while an exec of the fd may still use them, freed
+	 * by reap_work once the fd's slices are idle. Also under lock. */
+	struct list_head dead_regions;
+	struct work_struct reap_work;
+	vta_region_t *base_region;
+	u64 exec_base;
+	bool has_base;
+
+	/* Registered programs by handle, see vta_program_t. Also under lock. */
+	struct idr programs;
+
+	/* Pinned host buffers, see vta_pin_t. Also under lock. */
+	struct list_head pins;
+	u32 next_pin;
+	unsigned long pinned_pages;
+
+	/* Bulk copies run by copy_work in order. The queue is under
+	 * copy_lock, the sequence numbers under the slice lock like execs. */
+	spinlock_t copy_lock;
+	struct list_head copies;
+	struct work_struct copy_work;
+	u64 copy_submit_seq;
+	u64 copy_done_seq;
+	u64 copy_reaped_seq;
+
+	/* Submissions are numbered from 1 per open; protected by the slice lock. */
+	u64 submit_seq;
+	u64 done_seq;
+	u64 reaped_seq;
+	bool busy;
+	struct eventfd_ctx *evfd;
+	u64 submit_ns; /* of the exec on the device */
+	u64 start_ns;
+	u64 done_ns;
+	u64 ring_kick_ns;
+	vta_exec_rec_t hist[VTA_MAX_CONTEXTS]; /* by seq */
+
+	/* Gang members beyond the fd's own slice, see vta_gang_t. Each is a
+	 * file-less user bound to one more slice; they only change under
+	 * lock and live until the fd is closed. */
+	struct vta_user *gang[VTA_GANG_MAX - 1];
+	int gang_extra;
+	struct vta_user *owner; /* of a gang member, NULL for the fd itself */
+
+	/* Mappings of the slice's control page. While there are any, user
+	 * space owns the doorbell, the kernel submits nothing and the fd
+	 * counts as in flight. Under the slice lock. */
+	int ctrl_maps;
+
+	/* Submission contexts queued behind the running exec, started in
+	 * order from the completion path. Also under the slice lock. */
+	unsigned int nr_contexts;
+	u64 timeout_ns; /* per exec, 0 for exec_timeout_ms */
+	u64 deadline_ns; /* of the exec on the device, 0 for none */
+	unsigned int ctx_head;
+	unsigned int ctx_tail;
+	vta_exec64_t ctx_exec[VTA_MAX_CONTEXTS];
+	u64 ctx_base[VTA_MAX_CONTEXTS];
+	u64 ctx_submit_ns[VTA_MAX_CONTEXTS];
+
+	/* Command ring, see vta_ring_t. ring_head/ring_tail are the driver's
+	 * own copies, user space only gets to move tail through a kick. */
+	vta_ring_t __iomem *ring;
+	vta_region_t *ring_region;
+	u32 ring_mask;
+	u32 ring_head;
+	u32 ring_tail;
+	u32 ring_dropped;
+	bool ring_running;
+} vta_user_t;
+
+typedef struct {
+	vta_region_t *region;
+	u64 insn_offset; /* into region */
+	u32 insn_count;
+	u32 wait_cycles;
+} vta_program_buf_t;
+
+typedef struct {
+	struct list_head node;
+	u32 handle;
+	struct page **pages;
+	unsigned long nr_pages;
+	struct sg_table sgt;
+	int nents;
+	enum dma_data_direction dir;
+	struct mm_struct *mm; /* charged with nr_pages of pinned_vm */
+} vta_pin_buf_t;
+
+typedef struct {
+	struct list_head node;
+	vta_region_t *region;
+	u64 offset;
+	u64 size;
+	u32 dir;
+	struct page **pages;
+	unsigned long nr_pages;
+	unsigned int page_offset;
+} vta_copy_req_t;
+
+/* Exec counters of a slice, updated under its lock at start and
+ * completion. Latency bucket b counts execs of [2^b, 2^(b+1)) us, bucket 0
+ * everything below 2 us and the last one everything above. */
+#define VTA_HIST_BUCKETS 24
+
+typedef struct {
+	u64 execs;
+	u64 busy_ns;
+	u64 max_busy_ns;
+	u64 insns;
+	u64 wait_cycles;
+	u64 timeouts;
+	u64 hist[VTA_HIST_BUCKETS];
+} vta_slice_stats_t;
+
+/* Per-slice completion state.
+ *
+ * The device raises an interrupt when a slice leaves the running state.
+ * IO_IRQ_STATUS cannot say which one: in the packed layout it is a word of
+ * slice 1's control block. So the handler acks and lets every slice check
+ * its own status word, waking only the wait queues of slices that did
+ * finish; an exec still sleeps until its own slice is done. With MSI-X
+ * each slice has a vector of its own. */
+typedef struct {
+	wait_queue_head_t wq;
+	spinlock_t lock;
+	vta_user_t *user;
+	struct vta_dev *dev;
+	int idx;
+	int irq; /* own MSI-X vector, or 0 when sharing the device irq */
+
+	/* Hybrid polling: moving average of recent exec durations and how
+	 * each blocking exec ended up waiting. */
+	u64 avg_exec_ns;
+	atomic64_t spin_hits;
+	atomic64_t sleeps;
+
+	vta_slice_stats_t stats;
+} vta_slice_t;
 
+typedef struct vta_dev {
+	struct kref ref;
+	int minor;
+	struct pci_dev *pdev;
+	struct device *cdevice;
+	int pci_irq;
+	bool irq_per_slice;
+	void __iomem *mmio;
+	void __iomem *ctrl_mmio;
+	unsigned long pfn_dev_mem;
+	bool wc_reserved; /* BAR_RAM memtype, freed only if it was reserved */
+	bool addr64;
+	bool cycle_counter;
+	bool slice_reset;
+	size_t ctrl_size;
+	size_t ctrl_stride; /* ctrl_size, or two pages with ctrl_paged */
+	size_t ctrl_offset; /* of slice 0 in BAR0, past the irq page with ctrl_paged */
+	size_t ctrl_base_offset; /* of the dram base words, a page on with ctrl_paged */
+	bool ctrl_paged;
+
+	volatile int *slice_used;
+	int total_slice;
+	vta_slice_t *slices;
+	vta_buddy_t dram_buddy;
+
+	/* Admission queue of IOCTL_TVM_VTA_CMD_ACQUIRE. slice_used[] only
+	 * changes under admit_lock, and a freed slice goes straight to the
+	 * first waiter so late arrivals cannot barge in. */
+	spinlock_t admit_lock;
+	struct list_head admit_list;
+	wait_queue_head_t admit_wq;
+	unsigned int admit_depth;
+	unsigned int admit_max_depth;
+	u64 admit_waits;
+	u64 admit_timeouts;
+	u64 admit_wait_ns;
+	u64 admit_wait_max_ns;
+
+	/* BAR_RAM for the copy worker, or NULL if it could not be mapped. */
+	void __iomem *dram_kva;
+
+	/* Exec trace ring shared read-only with user space, or NULL. */
+	vta_trace_t *trace;
+	size_t trace_size;
+	atomic64_t trace_seq;
+
+	/* Load seen by the tvm-vta node: bound slices and execs on the device. */
+	atomic_t tenants;
+	atomic_t inflight;
+
+	/* Times out execs past their deadline, every watchdog_ms. */
+	struct delayed_work watchdog;
+
+	/* Host pages of all VTA_MAP_CACHED shadows, at most max_cached_mb. */
+	atomic_long_t cached_pages;
+} vta_dev_t;
+
+typedef struct {
+	struct list_head node;
+	u32 priority;
+	int slice; /* -1 until granted */
+} vta_waiter_t;
+
+static vta_dev_t *vta_devs[VTA_MAX_DEVS];
+static DEFINE_MUTEX(vta_devs_lock);
+static struct device *cdevice_any;
+
+static inline vta_slice_t *user_slice(vta_user_t *user) {
+	return &user->dev->slices[user->slice_idx];
+}
+
+/* A blocking exec first spins on the status register for up to
+ * spin_budget_ns, then sleeps until the interrupt. With spin_adaptive the
+ * budget follows the recent exec durations of the slice: short execs are
+ * spun on for twice their average, execs longer than the budget go to sleep
+ * right away. Both knobs are also attributes of the tvm-vta class. */
+static unsigned int spin_budget_ns = 20000;
+module_param(spin_budget_ns, uint, 0644);
+MODULE_PARM_DESC(spin_budget_ns, "Max time a blocking exec spins before sleeping (ns)");
+
+static bool spin_adaptive = true;
+module_param(spin_adaptive, bool, 0644);
+MODULE_PARM_DESC(spin_adaptive, "Tune the spin budget from recent exec durations");
+
+/* Shared mappings are populated on fault rather than at mmap() time. Each
+ * 4 KiB fault maps up to this many neighbouring pages as well. */
+static unsigned int fault_around_pages = 16;
+module_param(fault_around_pages, uint, 0644);
+MODULE_PARM_DESC(fault_around_pages, "Pages mapped per 4 KiB fault on device dram");
+
+/* Per-device exec trace ring, see vta_trace_t. 0 disables it. */
+#define VTA_TRACE_MAX_ENTRIES (1u << 20)
+static unsigned int trace_entries;
+module_param(trace_entries, uint, 0444);
+MODULE_PARM_DESC(trace_entries, "Records in the exec trace ring of each device, a power of two, 0 to disable");
+
+static unsigned int max_pinned_mb = 1024;
+module_param(max_pinned_mb, uint, 0644);
+MODULE_PARM_DESC(max_pinned_mb, "Host memory one open file may pin for device access");
+
+/* Shadows of VTA_MAP_CACHED regions are kernel memory any opener can ask
+ * for, so they are capped per device. */
+static unsigned int max_cached_mb = 256;
+module_param(max_cached_mb, uint, 0644);
+MODULE_PARM_DESC(max_cached_mb, "Host memory all VTA_MAP_CACHED regions of a device may use");
+
+/* Devices that stop a slice when its status word is cleared let the
+ * driver time out and cancel execs. Without that the slice would keep
+ * running while the driver starts the next exec on it, so deadlines and
+ * CANCEL are only offered with slice_reset. */
+static bool slice_reset;
+module_param(slice_reset, bool, 0444);
+MODULE_PARM_DESC(slice_reset, "Device stops a slice whose status word is cleared");
+
+/* Execs still running this long after their start are stopped by the
+ * watchdog and fail with ETIMEDOUT; IOCTL_TVM_VTA_CMD_SET_TIMEOUT
+ * overrides it per fd. Needs slice_reset. */
+static unsigned int exec_timeout_ms = 10000;
+module_param(exec_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(exec_timeout_ms, "Default exec deadline (ms), 0 for none");
+
+static unsigned int watchdog_ms = 100;
+module_param(watchdog_ms, uint, 0444);
+MODULE_PARM_DESC(watchdog_ms, "Period of the exec deadline check (ms)");
+
+static bool msix = true;
+module_param(msix, bool, 0444);
+MODULE_PARM_DESC(msix, "Give each slice its own MSI-X vector when the device has enough");
+
+static void region_put(vta_user_t *user, vta_region_t *region);
+static void pin_unlink(vta_user_t *user, vta_pin_buf_t *pin);
+static void pin_free(vta_dev_t *dev, vta_pin_buf_t *pin);
+static void program_release(vta_user_t *user, int id, vta_program_buf_t *prog);
+static void copy_work_fn(struct work_struct *work);
+static void reap_work_fn(struct work_struct *work);
+static void region_free(vta_user_t *user, vta_region_t *region);
+static void region_free_shadow(vta_dev_t *dev, vta_region_t *region);
+static void wc_memcpy_fromio(void *dst, const void __iomem *src, size_t n);
+static bool member_in_flight(vta_user_t *member);
+static bool user_in_flight(vta_user_t *user);
+static void user_quiesce(vta_user_t *user);
+static struct file_operations fops;
+
+/* vmas are split and duplicated behind our back, count them per region. */
 void mmap_open(struct vm_area_struct *vma)
 {
+	vta_user_t *user = (vta_user_t*) (vma->vm_file->private_data);
+	vta_region_t *region = vma->vm_private_data;
+
     printk(KERN_DEBUG "Entering: mmap open %lx\n", (long)vma);
+	mutex_lock(&user->lock);
+	region->maps++;
+	mutex_unlock(&user->lock);
 }
 
 void mmap_close(struct vm_area_struct *vma)
 {
+	vta_user_t *user = (vta_user_t*) (vma->vm_file->private_data);
+	vta_region_t *region = vma->vm_private_data;
+
     printk(KERN_DEBUG "Entering: mmap close %lx\n", (long)vma);
+	mutex_lock(&user->lock);
+	region_put(user, region);
+	mutex_unlock(&user->lock);
+}
+
+/* Page frame of the page at vmf->pgoff, or 0 if it lies past the region. */
+static unsigned long region_fault_pfn(vta_region_t *region, struct vm_fault *vmf) {
+	unsigned long page = vmf->pgoff - region->pgoff;
+
+	if (page >= (1UL << region->order))
+		return 0;
+	return region->pfn + page;
 }
 
-static int mmap_fault(struct vm_fault *vmf)
+/* Populate the page that faulted and, to cut the number of faults on
+ * streaming access, the aligned window of fault_around_pages around it,
+ * clamped to the vma and the region. */
+static vm_fault_t mmap_fault(struct vm_fault *vmf)
 {
-	// struct vm_area_struct *vma = vmf->vma;
-	// pgprot_t prot = vma->vm_page_prot;
-	// resource_size_t start = pci_resource_start(pdev, BAR);
-	// printk(KERN_DEBUG "start at %lx %lx\n", mmio, start);
-	// // resource_size_t cur = pfn_to_page(vmf->pgoff + start >> 12);
-	// unsigned long pfn = __phys_to_pfn(virt_to_phys(mmio)) + vmf->pgoff;
-	// unsigned long address = vmf->address + vmf->pgoff * 4096;
-	// // if (vma->vm_flags & VM_MIXEDMAP)
-	// // 	ret = vmf_insert_mixed_prot(vma, address,
-	// // 					__pfn_to_pfn_t(pfn, PFN_DEV),
-	// // 					prot);
-	// // else
-	// 	// ret = 
-	// printk(KERN_DEBUG "end at %lx %lx\n", mmio, pfn);
-	// if (vma->vm_flags & VM_MIXEDMAP)
-	// 	vm_insert_mixed(vma, address,
-	// 			__pfn_to_pfn_t(pfn, PFN_DEV));
-	// else
-	// 	vm_insert_pfn(vma, address, pfn);
-	return 1;
+	struct vm_area_struct *vma = vmf->vma;
+	vta_region_t *region = vma->vm_private_data;
+	unsigned long pfn = region_fault_pfn(region, vmf);
+	unsigned long window = max(fault_around_pages, 1U);
+	unsigned long addr = vmf->address & PAGE_MASK;
+	unsigned long start, end, page, cur;
+	vm_fault_t ret;
+
+	if (!pfn)
+		return VM_FAULT_SIGBUS;
+	/* A page mapped by a racing fault also comes back as NOPAGE. */
+	ret = vmf_insert_pfn(vma, addr, pfn);
+	if (ret != VM_FAULT_NOPAGE)
+		return ret;
+
+	window = rounddown_pow_of_two(window) << PAGE_SHIFT;
+	page = vmf->pgoff - region->pgoff;
+	start = max3(addr & ~(window - 1), vma->vm_start, addr - (page << PAGE_SHIFT));
+	end = min3((addr & ~(window - 1)) + window, vma->vm_end,
+			addr + (((1UL << region->order) - page) << PAGE_SHIFT));
+	for (cur = start; cur < end; cur += PAGE_SIZE) {
+		/* Pages already mapped are left alone. */
+		if (cur != addr)
+			vmf_insert_pfn(vma, cur, pfn + ((long)(cur - addr) >> PAGE_SHIFT));
+	}
+	return VM_FAULT_NOPAGE;
 }
 
+/* Device dram is only ever mapped with 4 KiB PTEs. Kernels of this
+ * vintage have no special huge PFN entries: a PMD or PUD pointing at BAR
+ * memory would be taken for a THP by zap and gup-fast, which then look
+ * for a struct page that does not exist. */
 struct vm_operations_struct mmap_vm_ops = {
 	.open = mmap_open,
 	.close = mmap_close,
 	.fault = mmap_fault,
 };
 
-typedef struct {
-	int dram_slice_idx;
-	void __iomem *ctrl_mmio;
-} vta_user_t;
+static void vta_dev_release(struct kref *ref);
+static void dev_put_slice(vta_dev_t *dev, int idx);
+
+/* Least loaded device with a free slice: most free DRAM first, then the
+ * fewest execs in flight. With every slice taken, the device with the
+ * shortest admission queue. vta_devs_lock held. */
+static vta_dev_t *vta_dev_pick(void) {
+	vta_dev_t *dev, *best = NULL, *queue = NULL;
+	int i;
+
+	for (i = 0; i < VTA_MAX_DEVS; i++) {
+		dev = vta_devs[i];
+		if (!dev)
+			continue;
+		if (!queue || READ_ONCE(dev->admit_depth) < READ_ONCE(queue->admit_depth))
+			queue = dev;
+		if (atomic_read(&dev->tenants) >= dev->total_slice)
+			continue;
+		if (!best || dev->dram_buddy.free_pages > best->dram_buddy.free_pages ||
+				(dev->dram_buddy.free_pages == best->dram_buddy.free_pages &&
+				 atomic_read(&dev->inflight) < atomic_read(&best->inflight)))
+			best = dev;
+	}
+	return best ? best : queue;
+}
+
+static vta_dev_t *vta_dev_get(unsigned int minor) {
+	vta_dev_t *dev = NULL;
+
+	mutex_lock(&vta_devs_lock);
+	if (minor == VTA_ANY_MINOR)
+		dev = vta_dev_pick();
+	else if (minor < VTA_MAX_DEVS)
+		dev = vta_devs[minor];
+	if (dev)
+		kref_get(&dev->ref);
+	mutex_unlock(&vta_devs_lock);
+	return dev;
+}
+
+static void user_init(vta_user_t *user, vta_dev_t *dev) {
+	user->dev = dev;
+	user->slice_idx = -1;
+	user->nr_contexts = 1;
+	mutex_init(&user->lock);
+	INIT_LIST_HEAD(&user->regions);
+	INIT_LIST_HEAD(&user->dead_regions);
+	INIT_WORK(&user->reap_work, reap_work_fn);
+	INIT_LIST_HEAD(&user->pins);
+	idr_init(&user->programs);
+	spin_lock_init(&user->copy_lock);
+	INIT_LIST_HEAD(&user->copies);
+	INIT_WORK(&user->copy_work, copy_work_fn);
+}
 
 int vta_open 	(struct inode *node, struct file *f) {
-	vta_user_t *user = (vta_user_t*)kmalloc(sizeof(vta_user_t), GFP_KERNEL);
+	vta_dev_t *dev = vta_dev_get(iminor(node));
+	vta_user_t *user;
+	if (!dev)
+		return -ENODEV;
+	user = (vta_user_t*)kzalloc(sizeof(vta_user_t), GFP_KERNEL);
+	if (!user) {
+		kref_put(&dev->ref, vta_dev_release);
+		return -ENOMEM;
+	}
 	f->private_data = user;
-	user->dram_slice_idx = -1;
+	user_init(user, dev);
 	return 0;
 }
 
+/* Detach a user from its slice, so that irq_handler() stops touching it. */
+static void user_detach_slice(vta_user_t *user) {
+	vta_slice_t *slice = user_slice(user);
+	unsigned long flags;
+
+	spin_lock_irqsave(&slice->lock, flags);
+	slice->user = NULL;
+	spin_unlock_irqrestore(&slice->lock, flags);
+}
+
+/* Detach a user from its slice before the slice is reused and hand the
+ * slice on. */
+static void user_release_slice(vta_user_t *user) {
+	user_detach_slice(user);
+	dev_put_slice(user->dev, user->slice_idx);
+	printk(KERN_ERR "Release slice %d\n", user->slice_idx);
+}
+
 int vta_close 	(struct inode *node, struct file *f) {
 	vta_user_t *user = (vta_user_t*) (f->private_data);
-	if (user->dram_slice_idx != -1) {
-		dram_used[user->dram_slice_idx] = 0;
-		printk(KERN_ERR "Release dram to partition %d\n", user->dram_slice_idx);
+	vta_region_t *region, *tmp;
+	vta_pin_buf_t *pin, *pin_tmp;
+	vta_program_buf_t *prog;
+	vta_user_t *member;
+	bool stuck;
+	int id;
+	/* Nothing of the fd may run on the device once its dram and pins are
+	 * gone, so first stop or drain its slice and those of its gang. */
+	user_quiesce(user);
+	for (id = 0; id < user->gang_extra; id++)
+		user_quiesce(user->gang[id]);
+	stuck = user_in_flight(user);
+	/* Queued copies hold their regions, let them finish first. */
+	flush_work(&user->copy_work);
+	/* Programs hold their regions too. */
+	idr_for_each_entry(&user->programs, prog, id)
+		program_release(user, id, prog);
+	idr_destroy(&user->programs);
+	/* Every vma holds the file, so regions are normally gone by now. */
+	list_for_each_entry_safe(region, tmp, &user->regions, node) {
+		region->maps = 1;
+		region_put(user, region);
+	}
+	/* Slices first, so nothing retires into reap_work behind our back. */
+	for (id = 0; id <= user->gang_extra; id++) {
+		member = id ? user->gang[id - 1] : user;
+		if (member->slice_idx == -1)
+			continue;
+		if (member_in_flight(member))
+			user_detach_slice(member);
+		else
+			user_release_slice(member);
+		if (id)
+			kfree(member);
+	}
+	cancel_work_sync(&user->reap_work);
+	if (stuck) {
+		/* A slice that neither stops nor completes may still read
+		 * and write all of it: leak the dram, the pins and the slice
+		 * rather than hand them out again. */
+		dev_warn(&user->dev->pdev->dev, "slices of a closed fd did not go idle, leaking them\n");
+		list_for_each_entry_safe(region, tmp, &user->dead_regions, node) {
+			list_del(&region->node);
+			region_free_shadow(user->dev, region);
+			kfree(region);
+		}
+		list_for_each_entry_safe(pin, pin_tmp, &user->pins, node) {
+			list_del(&pin->node);
+			mmdrop(pin->mm);
+			kfree(pin);
+		}
+	} else {
+		list_for_each_entry_safe(pin, pin_tmp, &user->pins, node) {
+			pin_unlink(user, pin);
+			pin_free(user->dev, pin);
+		}
+		list_for_each_entry_safe(region, tmp, &user->dead_regions, node) {
+			list_del(&region->node);
+			region_free(user, region);
+		}
 	}
+	if (user->evfd)
+		eventfd_ctx_put(user->evfd);
+	kref_put(&user->dev->ref, vta_dev_release);
 	kfree(f->private_data);
 	return 0;
 }
 
-int vta_mmap(struct file *filp, struct vm_area_struct *vma)
-{
-    printk(KERN_DEBUG "Entering: vma %lx\n", (long)vma);
-	unsigned long vma_size = vma->vm_end - vma->vm_start;
-	int i;
-	if (vma_size > DRAM_PAGE_PER_SLICE * 4096) {
-		printk(KERN_DEBUG "Dram size overflows %ld\n", vma_size);
-		return 1;
-	}
-    vma->vm_ops = &mmap_vm_ops;
-    vma->vm_flags |= VM_IO;
-	vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+static vta_region_t *user_find_region(vta_user_t *user, unsigned long pgoff) {
+	vta_region_t *region;
 
-	int old_value = 0;
-	for (i = 0;i < total_slice;i ++) {
-		if (cmpxchg(&dram_used[i], old_value, 1) == old_value) {
-			break;
-		}
+	list_for_each_entry(region, &user->regions, node) {
+		if (region->pgoff == pgoff)
+			return region;
 	}
+	return NULL;
+}
 
-	vta_user_t *user = (vta_user_t*) (filp->private_data);
+/* Take a free slice unless someone is queued for one. admit_lock held. */
+static int dev_take_slice(vta_dev_t *dev) {
+	int i;
 
-	if (i == total_slice || user->dram_slice_idx != -1) {
-		printk(KERN_DEBUG "Dram has been mapped to %d\n", user->dram_slice_idx);
-		return 1;
+	if (!list_empty(&dev->admit_list))
+		return -1;
+	for (i = 0;i < dev->total_slice;i ++) {
+		if (!dev->slice_used[i]) {
+			dev->slice_used[i] = 1;
+			atomic_inc(&dev->tenants);
+			return i;
+		}
 	}
-
-	user->dram_slice_idx = i;
-	user->ctrl_mmio = ctrl_mmio + (sizeof(u32) * 5) * i;
-
-	printk(KERN_ERR "Map dram to partition %d\n", user->dram_slice_idx);
-	return io_remap_pfn_range(vma, vma->vm_start, 
-		pfn_dev_mem + i * DRAM_PAGE_PER_SLICE, vma_size, vma->vm_page_prot);
+	return -1;
 }
 
-long device_exec(struct file* filp, unsigned long long arg) {
-	vta_exec_t exec;
-	vta_user_t *user = (vta_user_t*) (filp->private_data);
-	u32 status = 1;
-	if (copy_from_user(&exec, (const void*)arg, sizeof(exec)) != 0) {
-        printk(KERN_ERR "Copy data to user failed\n");
-        return -EFAULT;
-    }
-	iowrite32(exec.data[0], user->ctrl_mmio + sizeof(u32) * 0);
-	iowrite32(exec.data[1], user->ctrl_mmio + sizeof(u32) * 1);
-	iowrite32(exec.data[2], user->ctrl_mmio + sizeof(u32) * 2);
-	iowrite32(user->dram_slice_idx * DRAM_PAGE_PER_SLICE * 4096, user->ctrl_mmio + sizeof(u32) * 3);
-	iowrite32(status, user->ctrl_mmio + sizeof(u32) * 4);
-	while (1) {
-		status = ioread32(user->ctrl_mmio + sizeof(u32) * 4);
-		if (status != 1)
-			break;
+/* Hand a slice to the first waiter, or mark it free. */
+static void dev_put_slice(vta_dev_t *dev, int idx) {
+	vta_waiter_t *w;
+
+	spin_lock(&dev->admit_lock);
+	if (list_empty(&dev->admit_list)) {
+		dev->slice_used[idx] = 0;
+		atomic_dec(&dev->tenants);
+	} else {
+		w = list_first_entry(&dev->admit_list, vta_waiter_t, node);
+		list_del_init(&w->node);
+		dev->admit_depth--;
+		WRITE_ONCE(w->slice, idx);
+		wake_up_all(&dev->admit_wq);
 	}
-	return ioread32(user->ctrl_mmio + sizeof(u32) * 4);
+	spin_unlock(&dev->admit_lock);
 }
 
-static long vta_ioctl (struct file *file, unsigned int cmd, unsigned long arg) {
-    printk(KERN_DEBUG "Entering: %s\n", __func__);
-    switch (cmd) {
-        case IOCTL_TVM_VTA_CMD_EXEC:
-			return device_exec(file, arg);
-        default:                                    break;
-    }
-    return 0;
-}
+/* Queue for a slice by priority, then arrival. A grant that races with
+ * the timeout or a signal is kept. */
+static int dev_wait_slice(vta_dev_t *dev, u32 priority, s64 timeout_ns) {
+	vta_waiter_t w, *pos;
+	u64 start, waited;
+	long ret;
 
-/* These fops are a bit daft since read and write interfaces don't map well to IO registers.
- *
- * One ioctl per register would likely be the saner option. But we are lazy.
- *
- * We use the fact that every IO is aligned to 4 bytes. Misaligned reads means EOF. */
-static struct file_operations fops = {
-	.owner   = THIS_MODULE,
-	.mmap	 = vta_mmap,
-	.open	 = vta_open,
-	.release = vta_close,
-	.unlocked_ioctl = vta_ioctl
-};
+	spin_lock(&dev->admit_lock);
+	w.slice = dev_take_slice(dev);
+	if (w.slice >= 0 || timeout_ns == 0) {
+		spin_unlock(&dev->admit_lock);
+		return w.slice >= 0 ? w.slice : -EBUSY;
+	}
+	w.priority = priority;
+	list_for_each_entry(pos, &dev->admit_list, node) {
+		if (pos->priority < priority)
+			break;
+	}
+	list_add_tail(&w.node, &pos->node);
+	dev->admit_depth++;
+	if (dev->admit_depth > dev->admit_max_depth)
+		dev->admit_max_depth = dev->admit_depth;
+	spin_unlock(&dev->admit_lock);
 
-static irqreturn_t irq_handler(int irq, void *dev)
-{
-	int devi;
-	irqreturn_t ret;
-	u32 irq_status;
+	start = ktime_get_ns();
+	if (timeout_ns < 0) {
+		ret = wait_event_interruptible(dev->admit_wq, READ_ONCE(w.slice) >= 0);
+	} else {
+		ret = wait_event_interruptible_timeout(dev->admit_wq, READ_ONCE(w.slice) >= 0,
+				nsecs_to_jiffies(timeout_ns));
+		if (ret == 0)
+			ret = -ETIMEDOUT;
+	}
+	waited = ktime_get_ns() - start;
 
-	devi = *(int *)dev;
-	if (devi == major) {
-		irq_status = ioread32(mmio + IO_IRQ_STATUS);
-		pr_info("interrupt irq = %d dev = %d irq_status = %llx\n",
-				irq, devi, (unsigned long long)irq_status);
-		/* Must do this ACK, or else the interrupts just keeps firing. */
-		iowrite32(irq_status, mmio + IO_IRQ_ACK);
-		ret = IRQ_HANDLED;
+	spin_lock(&dev->admit_lock);
+	if (w.slice >= 0) {
+		ret = w.slice;
 	} else {
-		ret = IRQ_NONE;
+		list_del(&w.node);
+		dev->admit_depth--;
+		if (ret == -ETIMEDOUT)
+			dev->admit_timeouts++;
 	}
+	dev->admit_waits++;
+	dev->admit_wait_ns += waited;
+	if (waited > dev->admit_wait_max_ns)
+		dev->admit_wait_max_ns = waited;
+	spin_unlock(&dev->admit_lock);
 	return ret;
 }
 
-/**
- * Called just after insmod if the hardware device is connected,
- * not called otherwise.
- *
- * 0: all good
- * 1: failed
- */
-static int pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
-{
-	u8 val;
+static void user_bind_slice(vta_user_t *user, int i) {
+	vta_dev_t *dev = user->dev;
 
-	pr_info("pci_probe\n");
-	major = register_chrdev(0, CDEV_NAME, &fops);
-	pdev = dev;
-	pci_read_config_byte(dev, PCI_INTERRUPT_LINE, &val);
-	pr_info("irq pre %x\n", val);
-	if (pci_enable_device(dev) < 0) {
-		dev_err(&(pdev->dev), "pci_enable_device\n");
-		goto error;
+	user->slice_idx = i;
+	user->ctrl_mmio = dev->ctrl_mmio + dev->ctrl_stride * i;
+	dev->slices[i].user = user;
+}
+
+/* Bind a free slice to the user. User lock held. mmap_sem is held too on
+ * the mmap() path, so this never waits; see device_acquire(). */
+static int user_acquire_slice(vta_user_t *user) {
+	vta_dev_t *dev = user->dev;
+	int i;
+
+	spin_lock(&dev->admit_lock);
+	i = dev_take_slice(dev);
+	spin_unlock(&dev->admit_lock);
+	if (i < 0) {
+		printk(KERN_DEBUG "No free slice\n");
+		return -EBUSY;
 	}
+	user_bind_slice(user, i);
+	return 0;
+}
 
-    cdevice_class = class_create(THIS_MODULE, CDEV_NAME);
-    if (IS_ERR(cdevice_class))
-    {
-		printk(KERN_INFO "Class creation failed\n");
-		return PTR_ERR(cdevice_class);
-    }
+static void user_set_base(vta_user_t *user, vta_region_t *region) {
+	vta_slice_t *slice = user_slice(user);
+	unsigned long flags;
 
-	cdevice = device_create(cdevice_class, NULL, MKDEV(major, 0), NULL, CDEV_NAME"-0");
-    if (IS_ERR(cdevice))
-    {
-    	printk(KERN_INFO "Device creation failed\n");
-		class_destroy(cdevice_class);
-    	goto error;
-    }
+	spin_lock_irqsave(&slice->lock, flags);
+	user->base_region = region;
+	user->has_base = region != NULL;
+	user->exec_base = region ? region->dram_base : 0;
+	spin_unlock_irqrestore(&slice->lock, flags);
+}
 
-	dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32));
-	pci_set_master(dev);
-	if (pci_request_region(dev, BAR, "myregion0")) {
-		dev_err(&(pdev->dev), "pci_request_region\n");
-		goto error;
-	}
-	mmio = pci_iomap(pdev, BAR, pci_resource_len(pdev, BAR));
-	ctrl_mmio = mmio;
-	pfn_dev_mem = __phys_to_pfn(pci_resource_start(pdev, BAR_RAM));
+static inline u32 slice_status(vta_user_t *user) {
+	return ioread32(user->ctrl_mmio + sizeof(u32) * VTA_CTRL_STATUS);
+}
 
-	pr_info("bar 0 size %llx\n", pci_resource_len(pdev, BAR));
-	pr_info("bar 1 size %llx\n", pci_resource_len(pdev, BAR_RAM));
+static inline u64 slice_dram_base(vta_user_t *user) {
+	return user->exec_base;
+}
 
-	/* IRQ setup. */
-	pci_read_config_byte(dev, PCI_INTERRUPT_LINE, &val);
-	pci_irq = val;
-	if (request_irq(pci_irq, irq_handler, IRQF_SHARED, "pci_irq_handler0", &major) < 0) {
-		dev_err(&(dev->dev), "request_irq\n");
-		goto error;
-	}
+/* Program the dram base words, which the control page does not map. */
+static void slice_write_base(vta_user_t *user, u64 base) {
+	void __iomem *mmio = user->ctrl_mmio + user->dev->ctrl_base_offset;
+
+	iowrite32(lower_32_bits(base), mmio + sizeof(u32) * VTA_CTRL_DRAM_BASE);
+	if (user->dev->addr64)
+		iowrite32(upper_32_bits(base), mmio + sizeof(u32) * VTA_CTRL_DRAM_BASE_HI);
+}
 
-	total_slice = (pci_resource_len(pdev, BAR_RAM) / 4096) / DRAM_PAGE_PER_SLICE;
-	dram_used = kmalloc(sizeof(volatile int) * total_slice, __GFP_ZERO);
+/* Read-only mapping of the trace ring, vmalloc'ed so no pfn games. */
+static int vta_mmap_trace(vta_dev_t *dev, struct vm_area_struct *vma)
+{
+	if (!dev->trace)
+		return -ENODEV;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (vma->vm_end - vma->vm_start > dev->trace_size)
+		return -EINVAL;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	return remap_vmalloc_range(vma, dev->trace, 0);
+}
 
-	printk(KERN_INFO "DRAM has %d slices\n", total_slice);
+static void ctrl_vma_open(struct vm_area_struct *vma)
+{
+	vta_user_t *user = (vta_user_t*) (vma->vm_file->private_data);
+	vta_slice_t *slice = user_slice(user);
+	unsigned long flags;
 
-	return 0;
-error:
-	return 1;
+	spin_lock_irqsave(&slice->lock, flags);
+	user->ctrl_maps++;
+	spin_unlock_irqrestore(&slice->lock, flags);
+}
+
+/* Bring an exec rung from the control page to rest. The kernel does not
+ * track those, so go by the status word: clear it where the device can
+ * stop a slice, otherwise poll it for up to VTA_CLOSE_WAIT_MS. */
+static bool ctrl_quiesce(vta_user_t *user) {
+	unsigned long deadline = jiffies + msecs_to_jiffies(VTA_CLOSE_WAIT_MS);
+
+	if (slice_status(user) != VTA_STATUS_RUNNING)
+		return true;
+	if (user->dev->slice_reset) {
+		iowrite32(0, user->ctrl_mmio + sizeof(u32) * VTA_CTRL_STATUS);
+		return true;
+	}
+	while (slice_status(user) == VTA_STATUS_RUNNING) {
+		if (time_after(jiffies, deadline))
+			return false;
+		msleep(1);
+	}
+	return true;
 }
 
-static void pci_remove(struct pci_dev *dev)
+static void ctrl_vma_close(struct vm_area_struct *vma)
 {
-	pr_info("pci_remove\n");
-	free_irq(pci_irq, &major);
-	pci_release_region(dev, BAR);
-	unregister_chrdev(major, CDEV_NAME);
-	device_destroy(cdevice_class, MKDEV(major, 0));
-	class_destroy(cdevice_class);
+	vta_user_t *user = (vta_user_t*) (vma->vm_file->private_data);
+	vta_slice_t *slice = user_slice(user);
+	unsigned long flags;
+
+	/* The kernel gets the slice back with the last mapping, so the
+	 * doorbell must be quiet first; a mapping made meanwhile just keeps
+	 * the slice with user space. One that stays busy is kept from the
+	 * kernel for good: the fd counts as in flight and close() leaks it. */
+	if (READ_ONCE(user->ctrl_maps) == 1 && !ctrl_quiesce(user)) {
+		dev_warn(&user->dev->pdev->dev, "slice %d did not finish a control page exec, keeping it\n",
+				user->slice_idx);
+		return;
+	}
+	spin_lock_irqsave(&slice->lock, flags);
+	user->ctrl_maps--;
+	spin_unlock_irqrestore(&slice->lock, flags);
+	/* Regions unmapped meanwhile waited for the doorbell. */
+	if (!READ_ONCE(user->ctrl_maps) && !list_empty_careful(&user->dead_regions))
+		schedule_work(&user->reap_work);
 }
 
-static struct pci_driver pci_driver = {
-	.name     = "vta_pci",
-	.id_table = pci_ids,
-	.probe    = pci_probe,
-	.remove   = pci_remove,
+static const struct vm_operations_struct ctrl_vm_ops = {
+	.open = ctrl_vma_open,
+	.close = ctrl_vma_close,
 };
 
-static int myinit(void)
+/* Uncached mapping of the control page of the fd's slice. Every vma holds
+ * the file, so the slice stays bound to this fd while it is mapped, and
+ * VM_DONTCOPY keeps it out of children. */
+static int vta_mmap_control(vta_user_t *user, struct vm_area_struct *vma)
 {
-	if (pci_register_driver(&pci_driver) < 0) {
-		return 1;
-	}
-	return 0;
+	vta_dev_t *dev = user->dev;
+	vta_slice_t *slice;
+	unsigned long flags;
+	phys_addr_t phys;
+	int ret = 0;
+
+	if (!dev->ctrl_paged)
+		return -ENODEV;
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE || !(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+	mutex_lock(&user->lock);
+	if (user->slice_idx == -1)
+		ret = user_acquire_slice(user);
+	mutex_unlock(&user->lock);
+	if (ret)
+		return ret;
+
+	/* The kernel must not be halfway through an exec it started. The
+	 * doorbell runs against the base region, programmed here on the
+	 * page the owner cannot map. */
+	slice = user_slice(user);
+	spin_lock_irqsave(&slice->lock, flags);
+	if (!user->has_base)
+		ret = -EINVAL;
+	else if (user->busy || user->ctx_head != user->ctx_tail ||
+			(user->ring && user->ring_head != user->ring_tail))
+		ret = -EBUSY;
+	else if (!user->ctrl_maps++)
+		slice_write_base(user, user->exec_base);
+	spin_unlock_irqrestore(&slice->lock, flags);
+	if (ret)
+		return ret;
+
+	phys = pci_resource_start(dev->pdev, BAR) + dev->ctrl_offset +
+		dev->ctrl_stride * user->slice_idx;
+	vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP | VM_DONTCOPY;
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	vma->vm_ops = &ctrl_vm_ops;
+	ret = io_remap_pfn_range(vma, vma->vm_start, phys >> PAGE_SHIFT,
+			PAGE_SIZE, vma->vm_page_prot);
+	if (ret)
+		ctrl_vma_close(vma);
+	return ret;
 }
 
-static void myexit(void)
+int vta_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	pci_unregister_driver(&pci_driver);
+    printk(KERN_DEBUG "Entering: vma %lx\n", (long)vma);
+	unsigned long vma_size = vma->vm_end - vma->vm_start;
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_dev_t *dev = user->dev;
+	vta_region_t *region;
+	int order = get_order(vma_size);
+	long page_off;
+	int ret;
+
+	if (vma->vm_pgoff == VTA_MMAP_TRACE_OFFSET >> PAGE_SHIFT)
+		return vta_mmap_trace(dev, vma);
+	if (vma->vm_pgoff == VTA_MMAP_CONTROL_OFFSET >> PAGE_SHIFT)
+		return vta_mmap_control(user, vma);
+	if (vma->vm_pgoff >= VTA_MMAP_RESERVED_OFFSET >> PAGE_SHIFT)
+		return -EINVAL;
+	if (order > dev->dram_buddy.max_order) {
+		printk(KERN_DEBUG "Dram size overflows %ld\n", vma_size);
+		return -EINVAL;
+	}
+    vma->vm_ops = &mmap_vm_ops;
+
+	mutex_lock(&user->lock);
+	region = user_find_region(user, vma->vm_pgoff);
+	if (region) {
+		/* Mapping an existing region again, e.g. into a second range. */
+		if (order > region->order) {
+			ret = -EINVAL;
+			goto out;
+		}
+		region->maps++;
+	} else {
+		if (user->slice_idx == -1) {
+			ret = user_acquire_slice(user);
+			if (ret)
+				goto out;
+		}
+		region = kzalloc(sizeof(*region), GFP_KERNEL);
+		if (!region) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		/* Right-size the region: the smallest power-of-two block that
+		 * covers the mapping, instead of a whole fixed slice. */
+		page_off = buddy_alloc(&dev->dram_buddy, order);
+		if (page_off < 0) {
+			printk(KERN_DEBUG "No dram left for order %d\n", order);
+			kfree(region);
+			ret = -ENOMEM;
+			goto out;
+		}
+		region->pgoff = vma->vm_pgoff;
+		region->dram_base = (u64)page_off << PAGE_SHIFT;
+		region->pfn = dev->pfn_dev_mem + page_off;
+		region->order = order;
+		region->maps = 1;
+		region->flags = user->map_flags;
+		if (region->flags & VTA_MAP_CACHED) {
+			if (atomic_long_add_return(1L << order, &dev->cached_pages) <=
+					(long)READ_ONCE(max_cached_mb) << (20 - PAGE_SHIFT))
+				region->shadow = vmalloc_user(PAGE_SIZE << order);
+			if (!region->shadow) {
+				atomic_long_sub(1L << order, &dev->cached_pages);
+				buddy_free(&dev->dram_buddy, page_off, order);
+				kfree(region);
+				ret = -ENOMEM;
+				goto out;
+			}
+		}
+		list_add_tail(&region->node, &user->regions);
+		if (!user->has_base)
+			user_set_base(user, region);
+		printk(KERN_ERR "Map dram %llx order %d at offset %lx to slice %d\n",
+			region->dram_base, order, region->pgoff, user->slice_idx);
+	}
+
+	vma->vm_private_data = region;
+	if (region->shadow) {
+		/* Ordinary cached host pages, synced with dram by
+		 * device_sync(). A private copy would never see a sync. */
+		ret = (vma->vm_flags & VM_SHARED) ? remap_vmalloc_range(vma, region->shadow, 0) : -EINVAL;
+		if (ret)
+			region_put(user, region);
+		goto out;
+	}
+	vma->vm_flags |= VM_IO;
+	vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	if (vma->vm_flags & VM_SHARED) {
+		/* Nothing is mapped yet, mmap_fault() fills in what gets
+		 * touched. */
+		vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_NOHUGEPAGE;
+		ret = 0;
+		goto out;
+	}
+	/* Raw pfns cannot be inserted into a private (COW) mapping, so those
+	 * are still mapped up front. */
+	ret = io_remap_pfn_range(vma, vma->vm_start,
+		region->pfn, vma_size, vma->vm_page_prot);
+	if (ret)
+		region_put(user, region);
+out:
+	mutex_unlock(&user->lock);
+	return ret;
+}
+
+static inline u64 region_size(vta_region_t *region) {
+	return (u64)PAGE_SIZE << region->order;
+}
+
+/* Write the control block of the slice and start it. submit_ns is when
+ * the exec was handed to the driver. Slice lock held. */
+static void slice_start(vta_user_t *user, vta_exec64_t *exec, u64 base, u64 submit_ns) {
+	vta_slice_stats_t *stats;
+	u64 timeout;
+
+	iowrite32(lower_32_bits(exec->insn_phy_addr), user->ctrl_mmio + sizeof(u32) * VTA_CTRL_INSN_ADDR);
+	iowrite32(exec->insn_count, user->ctrl_mmio + sizeof(u32) * VTA_CTRL_INSN_COUNT);
+	iowrite32(exec->wait_cycles, user->ctrl_mmio + sizeof(u32) * VTA_CTRL_WAIT_CYCLES);
+	if (user->dev->addr64)
+		iowrite32(upper_32_bits(exec->insn_phy_addr), user->ctrl_mmio + sizeof(u32) * VTA_CTRL_INSN_ADDR_HI);
+	slice_write_base(user, base);
+	iowrite32(VTA_STATUS_RUNNING, user->ctrl_mmio + sizeof(u32) * VTA_CTRL_STATUS);
+	user->busy = true;
+	user->submit_ns = submit_ns;
+	user->start_ns = ktime_get_ns();
+	timeout = READ_ONCE(user->timeout_ns);
+	if (!timeout)
+		timeout = (u64)READ_ONCE(exec_timeout_ms) * NSEC_PER_MSEC;
+	user->deadline_ns = timeout && user->dev->slice_reset ? user->start_ns + timeout : 0;
+	atomic_inc(&user->dev->inflight);
+	stats = &user_slice(user)->stats;
+	stats->insns += exec->insn_count;
+	stats->wait_cycles += exec->wait_cycles;
+}
+
+static void slice_stats_done(vta_slice_stats_t *stats, u64 ns) {
+	int b = ns < 2000 ? 0 : ilog2(div_u64(ns, 1000));
+
+	stats->execs++;
+	stats->busy_ns += ns;
+	if (ns > stats->max_busy_ns)
+		stats->max_busy_ns = ns;
+	stats->hist[min(b, VTA_HIST_BUCKETS - 1)]++;
+}
+
+static void exec_from_v1(vta_exec64_t *dst, const vta_exec_t *src) {
+	dst->version = VTA_EXEC_VERSION;
+	dst->insn_count = src->insn_count;
+	dst->insn_phy_addr = src->insn_phy_addr;
+	dst->wait_cycles = src->wait_cycles;
+	dst->status = src->status;
+}
+
+/* Start the next queued submission context, if any. Slice lock held. */
+static bool ctx_start_next(vta_user_t *user) {
+	unsigned int i;
+
+	if (user->ctx_head == user->ctx_tail)
+		return false;
+	i = user->ctx_head++ & (VTA_MAX_CONTEXTS - 1);
+	user->ring_running = false;
+	slice_start(user, &user->ctx_exec[i], user->ctx_base[i], user->ctx_submit_ns[i]);
+	return true;
+}
+
+/* Start the next queued ring entry, if any. Slice lock held. */
+static void ring_start_next(vta_user_t *user) {
+	vta_exec_t entry;
+	vta_exec64_t exec;
+
+	user->ring_running = false;
+	if (!user->ring || user->ring_head == user->ring_tail)
+		return;
+	memcpy_fromio(&entry, &user->ring->entries[user->ring_head & user->ring_mask],
+			sizeof(entry));
+	exec_from_v1(&exec, &entry);
+	slice_start(user, &exec, slice_dram_base(user), user->ring_kick_ns);
+	user->ring_running = true;
+}
+
+/* Retire the running ring entry and publish the new head. Slice lock held. */
+static void ring_retire(vta_user_t *user, u32 status) {
+	iowrite32(status, &user->ring->entries[user->ring_head & user->ring_mask].status);
+	user->ring_head++;
+	iowrite32(user->ring_head, &user->ring->head);
+}
+
+/* Record the completion of the exec on the device with status and, with
+ * chain, start whatever is queued behind it. Slice lock held. */
+static void slice_retire(vta_slice_t *slice, vta_user_t *user, u32 status, bool chain) {
+	vta_user_t *owner;
+	vta_exec_rec_t *rec;
+
+	user->busy = false;
+	user->done_ns = ktime_get_ns();
+	atomic_dec(&user->dev->inflight);
+	slice_stats_done(&slice->stats, user->done_ns - user->start_ns);
+	/* Execs finish in submission order, one at a time. */
+	user->done_seq += 1 + user->ring_dropped;
+	user->ring_dropped = 0;
+	rec = &user->hist[user->done_seq & (VTA_MAX_CONTEXTS - 1)];
+	rec->status = status;
+	rec->cycles = user->dev->cycle_counter ?
+		ioread32(user->ctrl_mmio + sizeof(u32) * VTA_CTRL_CYCLES) : 0;
+	rec->submit_ns = user->submit_ns;
+	rec->start_ns = user->start_ns;
+	rec->done_ns = user->done_ns;
+	if (user->ring_running)
+		ring_retire(user, status);
+	user->ring_running = false;
+	/* Chain the next queued context or ring entry right away, the
+	 * device should not idle while work is queued. */
+	if (chain && !ctx_start_next(user))
+		ring_start_next(user);
+	if (user->evfd && !user->ring_running)
+		eventfd_signal(user->evfd, 1);
+	/* Unmapped regions wait for the fd to go idle. */
+	owner = user->owner ? user->owner : user;
+	if (!user->busy && !list_empty_careful(&owner->dead_regions))
+		schedule_work(&owner->reap_work);
+}
+
+/* Record the completion of a queued exec that never ran. Slice lock held. */
+static void slice_skip(vta_user_t *user, u32 status) {
+	vta_exec_rec_t *rec;
+
+	user->done_seq++;
+	rec = &user->hist[user->done_seq & (VTA_MAX_CONTEXTS - 1)];
+	memset(rec, 0, sizeof(*rec));
+	rec->status = status;
+	if (user->evfd)
+		eventfd_signal(user->evfd, 1);
+}
+
+/* Stop the exec on the device and complete it with status. With all, the
+ * queued contexts and ring entries behind it are completed with status
+ * too instead of being started. Slice lock held, user busy, and only on
+ * devices with slice_reset. */
+static void slice_abort(vta_slice_t *slice, vta_user_t *user, u32 status, bool all) {
+	/* Clearing the status word stops the slice and resets its block. */
+	iowrite32(0, user->ctrl_mmio + sizeof(u32) * VTA_CTRL_STATUS);
+	slice_retire(slice, user, status, !all);
+	if (!all)
+		return;
+	while (user->ctx_head != user->ctx_tail) {
+		user->ctx_head++;
+		slice_skip(user, status);
+	}
+	while (user->ring && user->ring_head != user->ring_tail) {
+		ring_retire(user, status);
+		slice_skip(user, status);
+	}
+}
+
+/* Record the completion of the in-flight exec of a slice, if any.
+ *
+ * Called from irq_handler() and from waiters, so a lost interrupt only
+ * delays the completion until somebody looks. Returns true if this call
+ * observed the completion. */
+static bool slice_complete(vta_slice_t *slice) {
+	vta_user_t *user;
+	unsigned long flags;
+	u32 status;
+	bool done = false;
+
+	spin_lock_irqsave(&slice->lock, flags);
+	user = slice->user;
+	if (user && user->busy) {
+		status = slice_status(user);
+		if (status != VTA_STATUS_RUNNING) {
+			slice_retire(slice, user, status, true);
+			done = true;
+		}
+	}
+	spin_unlock_irqrestore(&slice->lock, flags);
+	return done;
+}
+
+static bool seq_done(vta_user_t *user, u64 seq) {
+	slice_complete(user_slice(user));
+	return READ_ONCE(user->done_seq) >= seq;
+}
+
+static bool wait_seq_done(vta_user_t *user, u64 seq, bool copy) {
+	if (copy)
+		return READ_ONCE(user->copy_done_seq) >= seq;
+	return seq_done(user, seq);
+}
+
+/* Start exec on the slice of the user without waiting for it, against
+ * the dram base at base or the user's base region if NULL.
+ * Returns the sequence number of the submission. */
+static long slice_submit(vta_user_t *user, vta_exec64_t *exec, const u64 *base, u64 *seq) {
+	vta_slice_t *slice = user_slice(user);
+	unsigned long flags;
+	unsigned int i;
+
+	if (exec->version != VTA_EXEC_VERSION)
+		return -EINVAL;
+	if (!user->dev->addr64 && upper_32_bits(exec->insn_phy_addr))
+		return -EOVERFLOW;
+
+	spin_lock_irqsave(&slice->lock, flags);
+	if (!user->has_base) {
+		spin_unlock_irqrestore(&slice->lock, flags);
+		return -EINVAL;
+	}
+	if (user->ctrl_maps) {
+		spin_unlock_irqrestore(&slice->lock, flags);
+		return -EBUSY;
+	}
+	if (user->busy) {
+		/* Queue behind the running exec. Ring entries would have to
+		 * run first to keep completions in sequence order. */
+		if (user->ctx_tail - user->ctx_head + 1 >= READ_ONCE(user->nr_contexts) ||
+				user->ring_running || (user->ring && user->ring_head != user->ring_tail)) {
+			spin_unlock_irqrestore(&slice->lock, flags);
+			return -EBUSY;
+		}
+		i = user->ctx_tail++ & (VTA_MAX_CONTEXTS - 1);
+		user->ctx_exec[i] = *exec;
+		user->ctx_base[i] = base ? *base : slice_dram_base(user);
+		user->ctx_submit_ns[i] = ktime_get_ns();
+		*seq = ++user->submit_seq;
+		spin_unlock_irqrestore(&slice->lock, flags);
+		return 0;
+	}
+	*seq = ++user->submit_seq;
+	slice_start(user, exec, base ? *base : slice_dram_base(user), ktime_get_ns());
+	spin_unlock_irqrestore(&slice->lock, flags);
+	return 0;
+}
+
+static u64 slice_spin_budget(vta_slice_t *slice) {
+	u64 budget = READ_ONCE(spin_budget_ns);
+	u64 avg = READ_ONCE(slice->avg_exec_ns);
+
+	if (!spin_adaptive || !avg)
+		return budget;
+	return avg < budget ? min(2 * avg, budget) : 0;
+}
+
+/* Copy the record of completed submission seq. False once newer
+ * completions have overwritten it. */
+static bool seq_rec(vta_user_t *user, u64 seq, vta_exec_rec_t *rec) {
+	vta_slice_t *slice = user_slice(user);
+	unsigned long flags;
+	bool ok;
+
+	spin_lock_irqsave(&slice->lock, flags);
+	ok = user->done_seq - seq < VTA_MAX_CONTEXTS;
+	if (ok)
+		*rec = user->hist[seq & (VTA_MAX_CONTEXTS - 1)];
+	spin_unlock_irqrestore(&slice->lock, flags);
+	return ok;
+}
+
+/* Feed the run time of one exec into the spin budget. By the time its
+ * waiter gets here the slice may have chained further execs, so the times
+ * come from the exec's own record, not from the user. */
+static void slice_account_exec(vta_slice_t *slice, const vta_exec_rec_t *rec) {
+	u64 avg = slice->avg_exec_ns;
+	u64 ns;
+
+	/* Skipped execs never started. */
+	if (!rec->start_ns || rec->done_ns < rec->start_ns)
+		return;
+	ns = rec->done_ns - rec->start_ns;
+
+	/* EWMA with a weight of 1/8 for the newest sample. */
+	WRITE_ONCE(slice->avg_exec_ns, avg ? avg - (avg >> 3) + (ns >> 3) : ns);
+}
+
+/* Spin on the status register for up to budget_ns. */
+static bool exec_spin(vta_user_t *user, u64 seq, u64 budget_ns) {
+	u64 deadline;
+
+	if (!budget_ns)
+		return false;
+	deadline = ktime_get_ns() + budget_ns;
+	do {
+		if (seq_done(user, seq))
+			return true;
+		cpu_relax();
+	} while (ktime_get_ns() < deadline && !need_resched());
+	return false;
+}
+
+/* Publish one record into the trace ring of the device. */
+static void trace_exec(vta_dev_t *dev, vta_user_t *user, vta_exec64_t *exec,
+		const vta_exec_rec_t *done, u64 t_enter, u64 t_copied, u64 t_return) {
+	vta_trace_t *trace = dev->trace;
+	vta_trace_rec_t *rec;
+	u64 i;
+
+	i = atomic64_inc_return(&dev->trace_seq) - 1;
+	rec = &trace->records[i & (trace->entries - 1)];
+	WRITE_ONCE(rec->seq, 0);
+	smp_wmb();
+	rec->t_enter = t_enter;
+	rec->t_copied = t_copied;
+	rec->t_start = done->start_ns;
+	rec->t_done = done->done_ns;
+	rec->t_return = t_return;
+	rec->pid = task_pid_nr(current);
+	rec->slice = user->slice_idx;
+	rec->insn_count = exec->insn_count;
+	rec->status = done->status;
+	smp_wmb();
+	WRITE_ONCE(rec->seq, i + 1);
+	WRITE_ONCE(trace->head, atomic64_read(&dev->trace_seq));
+}
+
+/* Blocking execs report execs the driver stopped as errors. */
+static long status_to_ret(u32 status) {
+	if (status == VTA_STATUS_TIMEDOUT)
+		return -ETIMEDOUT;
+	if (status == VTA_STATUS_CANCELED)
+		return -ECANCELED;
+	return status;
+}
+
+/* Wait for submission seq of exec; returns its final slice status. */
+static long exec_wait(vta_user_t *user, vta_exec64_t *exec, u64 seq,
+		u64 t_enter, u64 t_copied) {
+	vta_slice_t *slice = user_slice(user);
+	vta_exec_rec_t rec;
+
+	if (exec_spin(user, seq, slice_spin_budget(slice))) {
+		atomic64_inc(&slice->spin_hits);
+	} else {
+		/* Sleep until irq_handler() reports this slice; the status register
+		 * is the source of truth, so spurious or shared wakeups just
+		 * re-check it. */
+		atomic64_inc(&slice->sleeps);
+		if (wait_event_killable(slice->wq, seq_done(user, seq)))
+			return -EINTR;
+	}
+	user->reaped_seq = seq;
+	/* Chained ring entries may have overwritten the record already. */
+	if (!seq_rec(user, seq, &rec))
+		return -ENOENT;
+	slice_account_exec(slice, &rec);
+	if (user->dev->trace)
+		trace_exec(user->dev, user, exec, &rec, t_enter, t_copied, ktime_get_ns());
+	return status_to_ret(rec.status);
+}
+
+/* Run exec and wait for it; returns the final slice status. */
+static long exec_blocking(vta_user_t *user, vta_exec64_t *exec, const u64 *base,
+		u64 t_enter, u64 t_copied) {
+	u64 seq;
+	long ret;
+
+	ret = slice_submit(user, exec, base, &seq);
+	if (ret)
+		return ret;
+	return exec_wait(user, exec, seq, t_enter, t_copied);
+}
+
+long device_exec(struct file* filp, unsigned long long arg) {
+	vta_exec_t exec;
+	vta_exec64_t exec64;
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	u64 t_enter;
+	t_enter = ktime_get_ns();
+	if (user->slice_idx == -1) {
+		printk(KERN_ERR "Exec without a mapped dram\n");
+		return -EINVAL;
+	}
+	if (copy_from_user(&exec, (const void*)arg, sizeof(exec)) != 0) {
+        printk(KERN_ERR "Copy data to user failed\n");
+        return -EFAULT;
+    }
+	exec_from_v1(&exec64, &exec);
+	return exec_blocking(user, &exec64, NULL, t_enter, ktime_get_ns());
+}
+
+long device_exec64(struct file* filp, unsigned long long arg) {
+	vta_exec64_t exec;
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	u64 t_enter;
+	t_enter = ktime_get_ns();
+	if (user->slice_idx == -1)
+		return -EINVAL;
+	if (copy_from_user(&exec, (const void*)arg, sizeof(exec)) != 0)
+		return -EFAULT;
+	return exec_blocking(user, &exec, NULL, t_enter, ktime_get_ns());
+}
+
+long device_submit(struct file* filp, unsigned long long arg) {
+	vta_submit_t submit;
+	vta_exec64_t exec;
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	long ret;
+	if (user->slice_idx == -1)
+		return -EINVAL;
+	if (copy_from_user(&submit, (const void*)arg, sizeof(submit)) != 0)
+		return -EFAULT;
+	exec_from_v1(&exec, &submit.exec);
+	ret = slice_submit(user, &exec, NULL, &submit.seq);
+	if (ret)
+		return ret;
+	if (copy_to_user(&((vta_submit_t __user *)arg)->seq, &submit.seq, sizeof(submit.seq)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+long device_submit64(struct file* filp, unsigned long long arg) {
+	vta_submit64_t submit;
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	long ret;
+	if (user->slice_idx == -1)
+		return -EINVAL;
+	if (copy_from_user(&submit, (const void*)arg, sizeof(submit)) != 0)
+		return -EFAULT;
+	ret = slice_submit(user, &submit.exec, NULL, &submit.seq);
+	if (ret)
+		return ret;
+	if (copy_to_user(&((vta_submit64_t __user *)arg)->seq, &submit.seq, sizeof(submit.seq)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+long device_wait(struct file* filp, unsigned long long arg) {
+	vta_wait_t wait;
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_exec_rec_t rec;
+	vta_slice_t *slice;
+	u64 submitted;
+	bool copy;
+	long ret;
+	if (user->slice_idx == -1)
+		return -EINVAL;
+	if (copy_from_user(&wait, (const void*)arg, sizeof(wait)) != 0)
+		return -EFAULT;
+	if (wait.flags & ~VTA_WAIT_FLAGS_MASK)
+		return -EINVAL;
+	copy = wait.flags & VTA_WAIT_COPY;
+	submitted = copy ? READ_ONCE(user->copy_submit_seq) : user->submit_seq;
+	if (wait.seq == 0)
+		wait.seq = submitted;
+	if (wait.seq > submitted)
+		return -EINVAL;
+	slice = user_slice(user);
+	if (wait.timeout_ns < 0) {
+		ret = wait_event_interruptible(slice->wq, wait_seq_done(user, wait.seq, copy));
+		if (ret)
+			return ret;
+	} else {
+		ret = wait_event_interruptible_timeout(slice->wq, wait_seq_done(user, wait.seq, copy),
+				nsecs_to_jiffies(wait.timeout_ns));
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			return -ETIMEDOUT;
+	}
+	if (copy) {
+		wait.status = 0;
+		if (wait.seq > user->copy_reaped_seq)
+			user->copy_reaped_seq = wait.seq;
+		goto out;
+	}
+	if (wait.seq > user->reaped_seq)
+		user->reaped_seq = wait.seq;
+	/* Ring entries carry their own status too. */
+	if (!seq_rec(user, wait.seq, &rec))
+		return -ENOENT;
+	wait.status = rec.status;
+out:
+	if (copy_to_user((void __user *)arg, &wait, sizeof(wait)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+long device_exec_times(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_exec_times_t times;
+	vta_exec_rec_t rec;
+	vta_slice_t *slice;
+	unsigned long flags;
+	u64 done;
+
+	if (user->slice_idx == -1)
+		return -EINVAL;
+	if (copy_from_user(&times, (const void*)arg, sizeof(times)) != 0)
+		return -EFAULT;
+	slice = user_slice(user);
+	slice_complete(slice);
+	spin_lock_irqsave(&slice->lock, flags);
+	done = user->done_seq;
+	if (times.seq == 0)
+		times.seq = done;
+	rec = user->hist[times.seq & (VTA_MAX_CONTEXTS - 1)];
+	spin_unlock_irqrestore(&slice->lock, flags);
+	if (times.seq == 0 || times.seq > user->submit_seq)
+		return -EINVAL;
+	if (times.seq > done)
+		return -EAGAIN;
+	if (done - times.seq >= VTA_MAX_CONTEXTS)
+		return -ENOENT;
+
+	times.status = rec.status;
+	times.flags = user->dev->cycle_counter ? VTA_TIMES_CYCLES : 0;
+	times.cycles = rec.cycles;
+	times.t_submit = rec.submit_ns;
+	times.t_start = rec.start_ns;
+	times.t_complete = rec.done_ns;
+	if (copy_to_user((void __user *)arg, &times, sizeof(times)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+long device_acquire(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_acquire_t acq;
+	long ret;
+
+	if (copy_from_user(&acq, (const void*)arg, sizeof(acq)) != 0)
+		return -EFAULT;
+	mutex_lock(&user->lock);
+	ret = user->slice_idx;
+	mutex_unlock(&user->lock);
+	if (ret == -1) {
+		/* Waiting under user->lock would stall munmap() of this fd. */
+		ret = dev_wait_slice(user->dev, acq.priority, acq.timeout_ns);
+		if (ret < 0)
+			return ret;
+		mutex_lock(&user->lock);
+		if (user->slice_idx == -1) {
+			user_bind_slice(user, ret);
+		} else {
+			/* Another thread mapped meanwhile. */
+			dev_put_slice(user->dev, ret);
+			ret = user->slice_idx;
+		}
+		mutex_unlock(&user->lock);
+	}
+	acq.slice = ret;
+	if (copy_to_user((void __user *)arg, &acq, sizeof(acq)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+long device_set_eventfd(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	struct eventfd_ctx *evfd = NULL, *old;
+	vta_slice_t *slice;
+	unsigned long flags;
+	int fd = (int)arg;
+
+	if (fd >= 0) {
+		evfd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(evfd))
+			return PTR_ERR(evfd);
+	}
+	if (user->slice_idx != -1) {
+		slice = user_slice(user);
+		spin_lock_irqsave(&slice->lock, flags);
+		old = user->evfd;
+		user->evfd = evfd;
+		spin_unlock_irqrestore(&slice->lock, flags);
+	} else {
+		old = user->evfd;
+		user->evfd = evfd;
+	}
+	if (old)
+		eventfd_ctx_put(old);
+	return 0;
+}
+
+long device_ring_setup(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_ring_setup_t setup;
+	vta_ring_t __iomem *ring;
+	vta_slice_t *slice;
+	unsigned long flags;
+	size_t size;
+
+	long ret = 0;
+
+	if (copy_from_user(&setup, (const void*)arg, sizeof(setup)) != 0)
+		return -EFAULT;
+	if (setup.entries == 0 || setup.entries > VTA_RING_MAX_ENTRIES ||
+			(setup.entries & (setup.entries - 1)) || (setup.offset & 63))
+		return -EINVAL;
+	size = sizeof(vta_ring_t) + setup.entries * sizeof(vta_exec_t);
+
+	/* The ring lives in the base region, offset is relative to it. */
+	mutex_lock(&user->lock);
+	if (!user->base_region || setup.offset + size > region_size(user->base_region) ||
+			user->base_region->shadow) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (user->ring) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ring = ioremap_wc((user->base_region->pfn << PAGE_SHIFT) + setup.offset, size);
+	if (!ring) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	iowrite32(0, &ring->head);
+	iowrite32(0, &ring->tail);
+
+	slice = user_slice(user);
+	spin_lock_irqsave(&slice->lock, flags);
+	user->ring_mask = setup.entries - 1;
+	user->ring_head = 0;
+	user->ring_tail = 0;
+	user->ring = ring;
+	user->ring_region = user->base_region;
+	spin_unlock_irqrestore(&slice->lock, flags);
+	printk(KERN_DEBUG "Ring of %u entries at %x\n", setup.entries, setup.offset);
+out:
+	mutex_unlock(&user->lock);
+	return ret;
+}
+
+/* Stop chaining ring entries and drop the kernel mapping of the ring.
+ * An entry already on the device runs to completion. User lock held. */
+static void ring_teardown(vta_user_t *user) {
+	vta_slice_t *slice = user_slice(user);
+	vta_ring_t __iomem *ring;
+	unsigned long flags;
+
+	spin_lock_irqsave(&slice->lock, flags);
+	ring = user->ring;
+	/* Entries that never ran still hold sequence numbers. Count them as
+	 * done, after the exec on the device if there is one, so waiters do
+	 * not hang on them. */
+	user->ring_dropped = user->ring_tail - user->ring_head - user->ring_running;
+	if (!user->busy) {
+		user->done_seq += user->ring_dropped;
+		user->ring_dropped = 0;
+	}
+	user->ring = NULL;
+	user->ring_region = NULL;
+	user->ring_running = false;
+	user->ring_head = user->ring_tail = 0;
+	spin_unlock_irqrestore(&slice->lock, flags);
+	if (ring)
+		iounmap(ring);
+}
+
+static void region_free_shadow(vta_dev_t *dev, vta_region_t *region) {
+	if (!region->shadow)
+		return;
+	vfree(region->shadow);
+	atomic_long_sub(1L << region->order, &dev->cached_pages);
+}
+
+static void region_free(vta_user_t *user, vta_region_t *region) {
+	region_free_shadow(user->dev, region);
+	buddy_free(&user->dev->dram_buddy, region->dram_base >> PAGE_SHIFT, region->order);
+	printk(KERN_DEBUG "Release dram %llx order %d\n", region->dram_base, region->order);
+	kfree(region);
+}
+
+static bool member_in_flight(vta_user_t *member) {
+	if (member->slice_idx == -1)
+		return false;
+	return READ_ONCE(member->busy) || READ_ONCE(member->ctx_head) != READ_ONCE(member->ctx_tail) ||
+		(member->ring && READ_ONCE(member->ring_head) != READ_ONCE(member->ring_tail)) ||
+		READ_ONCE(member->ctrl_maps);
+}
+
+/* Whether an exec of the fd, or of its gang, is running or queued. Any of
+ * them may use any region of the fd. User lock held. */
+static bool user_in_flight(vta_user_t *user) {
+	int i;
+
+	for (i = 0; i <= user->gang_extra; i++) {
+		if (member_in_flight(i ? user->gang[i - 1] : user))
+			return true;
+	}
+	return false;
+}
+
+/* Bring the slice of a closing fd, or of one of its gang members, to
+ * rest: stop what runs and drop what is queued where the device can
+ * stop a slice, otherwise let the queue run dry. Gives up after
+ * VTA_CLOSE_WAIT_MS on a slice that does not complete. */
+static void user_quiesce(vta_user_t *user) {
+	vta_slice_t *slice;
+	unsigned long flags;
+
+	if (user->slice_idx == -1)
+		return;
+	slice = user_slice(user);
+	if (user->dev->slice_reset) {
+		spin_lock_irqsave(&slice->lock, flags);
+		if (user->busy)
+			slice_abort(slice, user, VTA_STATUS_CANCELED, true);
+		spin_unlock_irqrestore(&slice->lock, flags);
+		return;
+	}
+	/* Not killable: a dying task closes its files with SIGKILL pending. */
+	wait_event_timeout(slice->wq, (slice_complete(slice), !member_in_flight(user)),
+			msecs_to_jiffies(VTA_CLOSE_WAIT_MS));
+}
+
+/* Drop one mapping of a region and free it with the last one. User lock
+ * held. The dram goes back to the allocator only once no exec of the fd
+ * can still touch it; until then the region sits on dead_regions. New
+ * execs cannot pick it up: it is no longer the base and has no program. */
+static void region_put(vta_user_t *user, vta_region_t *region) {
+	if (--region->maps > 0)
+		return;
+	if (user->ring && user->ring_region == region)
+		ring_teardown(user);
+	if (user->base_region == region)
+		user_set_base(user, NULL);
+	list_del(&region->node);
+	if (user_in_flight(user)) {
+		list_add_tail(&region->node, &user->dead_regions);
+		schedule_work(&user->reap_work);
+		return;
+	}
+	region_free(user, region);
+}
+
+static void reap_work_fn(struct work_struct *work) {
+	vta_user_t *user = container_of(work, vta_user_t, reap_work);
+	vta_region_t *region, *tmp;
+
+	mutex_lock(&user->lock);
+	if (!user_in_flight(user)) {
+		list_for_each_entry_safe(region, tmp, &user->dead_regions, node) {
+			list_del(&region->node);
+			region_free(user, region);
+		}
+	}
+	mutex_unlock(&user->lock);
+}
+
+long device_region_info(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_region_info_t info;
+	vta_region_t *region;
+
+	if (copy_from_user(&info, (const void*)arg, sizeof(info)) != 0)
+		return -EFAULT;
+	mutex_lock(&user->lock);
+	region = user_find_region(user, info.offset >> PAGE_SHIFT);
+	if (region) {
+		info.size = region_size(region);
+		info.dram_addr = region->dram_base;
+		info.is_base = region == user->base_region;
+	}
+	mutex_unlock(&user->lock);
+	if (!region)
+		return -ENOENT;
+	if (copy_to_user((void __user *)arg, &info, sizeof(info)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+long device_set_map_flags(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+
+	if (arg & ~VTA_MAP_FLAGS_MASK)
+		return -EINVAL;
+	mutex_lock(&user->lock);
+	user->map_flags = arg;
+	mutex_unlock(&user->lock);
+	return 0;
+}
+
+/* Move [offset, offset + size) of a cached region between its host copy
+ * and dram, widened to whole cache lines. Only the requested lines are
+ * touched, the rest of the region is left as it is. */
+long device_sync(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	void __iomem *dram;
+	vta_region_t *region;
+	vta_sync_t sync;
+	u64 start, end, n;
+	long ret = 0;
+
+	if (copy_from_user(&sync, (const void*)arg, sizeof(sync)) != 0)
+		return -EFAULT;
+	if (!sync.size || sync.dir > VTA_SYNC_FOR_CPU)
+		return -EINVAL;
+	if (!user->dev->dram_kva)
+		return -ENODEV;
+	mutex_lock(&user->lock);
+	region = user_find_region(user, sync.region >> PAGE_SHIFT);
+	if (!region) {
+		ret = -ENOENT;
+		goto out;
+	}
+	if (!region->shadow || sync.offset > region_size(region) ||
+			sync.size > region_size(region) - sync.offset) {
+		ret = -EINVAL;
+		goto out;
+	}
+	/* Hold the region rather than the lock, munmap() on the fd need not
+	 * wait for a long sync. */
+	region->maps++;
+	mutex_unlock(&user->lock);
+
+	start = round_down(sync.offset, L1_CACHE_BYTES);
+	end = round_up(sync.offset + sync.size, L1_CACHE_BYTES);
+	dram = user->dev->dram_kva + region->dram_base;
+	/* A page at a time, like copy_run(), so a sync of a large region
+	 * neither keeps the FPU section of wc_memcpy_fromio() open nor hogs
+	 * the CPU. */
+	for (; start < end; start += n) {
+		n = min_t(u64, PAGE_SIZE - (start & ~PAGE_MASK), end - start);
+		if (sync.dir == VTA_SYNC_FOR_DEVICE)
+			memcpy_toio(dram + start, region->shadow + start, n);
+		else
+			wc_memcpy_fromio(region->shadow + start, dram + start, n);
+		cond_resched();
+	}
+	if (sync.dir == VTA_SYNC_FOR_DEVICE)
+		wmb();
+
+	mutex_lock(&user->lock);
+	region_put(user, region);
+out:
+	mutex_unlock(&user->lock);
+	return ret;
+}
+
+long device_set_contexts(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+
+	if (arg < 1 || arg > VTA_MAX_CONTEXTS)
+		return -EINVAL;
+	WRITE_ONCE(user->nr_contexts, arg);
+	return 0;
+}
+
+long device_set_timeout(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	int i;
+
+	if (!user->dev->slice_reset)
+		return -EOPNOTSUPP;
+	mutex_lock(&user->lock);
+	WRITE_ONCE(user->timeout_ns, arg);
+	for (i = 0; i < user->gang_extra; i++)
+		WRITE_ONCE(user->gang[i]->timeout_ns, arg);
+	mutex_unlock(&user->lock);
+	return 0;
+}
+
+/* Stop everything the fd has on its slices, gang members included. */
+long device_cancel(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_user_t *member;
+	vta_slice_t *slice;
+	unsigned long flags;
+	int i;
+
+	if (!user->dev->slice_reset)
+		return -EOPNOTSUPP;
+	mutex_lock(&user->lock);
+	if (user->slice_idx == -1) {
+		mutex_unlock(&user->lock);
+		return -EINVAL;
+	}
+	for (i = 0; i <= user->gang_extra; i++) {
+		member = i ? user->gang[i - 1] : user;
+		slice = user_slice(member);
+		slice_complete(slice);
+		spin_lock_irqsave(&slice->lock, flags);
+		if (member->busy)
+			slice_abort(slice, member, VTA_STATUS_CANCELED, true);
+		spin_unlock_irqrestore(&slice->lock, flags);
+		wake_up(&slice->wq);
+	}
+	mutex_unlock(&user->lock);
+	return 0;
+}
+
+/* Select the region execs run against, by its mmap offset in bytes. */
+long device_set_base(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_region_t *region;
+	long ret = 0;
+
+	mutex_lock(&user->lock);
+	region = user_find_region(user, arg >> PAGE_SHIFT);
+	if (!region)
+		ret = -ENOENT;
+	else if (user->ring || READ_ONCE(user->busy) || READ_ONCE(user->ctrl_maps))
+		ret = -EBUSY;
+	else
+		user_set_base(user, region);
+	mutex_unlock(&user->lock);
+	return ret;
+}
+
+/* Drop a program and its hold on the region. User lock held, or the file
+ * is going away. */
+static void program_release(vta_user_t *user, int id, vta_program_buf_t *prog) {
+	idr_remove(&user->programs, id);
+	region_put(user, prog->region);
+	kfree(prog);
+}
+
+long device_register_program(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_program_t req;
+	vta_program_buf_t *prog;
+	u64 bytes;
+	int id;
+
+	if (copy_from_user(&req, (const void*)arg, sizeof(req)) != 0)
+		return -EFAULT;
+	bytes = (u64)req.insn_count * VTA_INSN_BYTES;
+	if (!req.insn_count || !IS_ALIGNED(req.insn_phy_addr, VTA_INSN_BYTES))
+		return -EINVAL;
+	prog = kzalloc(sizeof(*prog), GFP_KERNEL);
+	if (!prog)
+		return -ENOMEM;
+	prog->insn_offset = req.insn_phy_addr;
+	prog->insn_count = req.insn_count;
+	prog->wait_cycles = req.wait_cycles;
+
+	mutex_lock(&user->lock);
+	if (!user->base_region || req.insn_phy_addr > region_size(user->base_region) ||
+			bytes > region_size(user->base_region) - req.insn_phy_addr) {
+		mutex_unlock(&user->lock);
+		kfree(prog);
+		return -EINVAL;
+	}
+	id = idr_alloc(&user->programs, prog, 1, 0, GFP_KERNEL);
+	if (id < 0) {
+		mutex_unlock(&user->lock);
+		kfree(prog);
+		return id;
+	}
+	prog->region = user->base_region;
+	prog->region->maps++;
+	mutex_unlock(&user->lock);
+
+	req.handle = id;
+	if (copy_to_user(&((vta_program_t __user *)arg)->handle, &req.handle, sizeof(req.handle)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+long device_unregister_program(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_program_buf_t *prog;
+
+	mutex_lock(&user->lock);
+	prog = arg <= INT_MAX ? idr_find(&user->programs, arg) : NULL;
+	if (prog)
+		program_release(user, arg, prog);
+	mutex_unlock(&user->lock);
+	return prog ? 0 : -ENOENT;
+}
+
+/* Build the exec of a program run base_offset bytes into its region.
+ * Everything was checked at registration, only the handle and the offset
+ * are looked at here. User lock held. */
+static long program_exec(vta_user_t *user, u32 handle, u64 base_offset,
+		vta_exec64_t *exec, u64 *base) {
+	vta_program_buf_t *prog;
+
+	prog = idr_find(&user->programs, handle);
+	if (!prog)
+		return -ENOENT;
+	if (base_offset >= region_size(prog->region))
+		return -EINVAL;
+	/* The region is held by the program, its dram cannot move. */
+	*base = prog->region->dram_base + base_offset;
+	exec->version = VTA_EXEC_VERSION;
+	exec->insn_phy_addr = prog->insn_offset - base_offset;
+	if (!user->dev->addr64)
+		exec->insn_phy_addr = lower_32_bits(exec->insn_phy_addr);
+	exec->insn_count = prog->insn_count;
+	exec->wait_cycles = prog->wait_cycles;
+	exec->status = 0;
+	return 0;
+}
+
+long device_launch(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_launch_t launch;
+	vta_exec64_t exec;
+	u64 t_enter, base, seq;
+	long ret;
+
+	t_enter = ktime_get_ns();
+	if (copy_from_user(&launch, (const void*)arg, sizeof(launch)) != 0)
+		return -EFAULT;
+	if (launch.flags & ~VTA_LAUNCH_WAIT)
+		return -EINVAL;
+
+	/* Submit under the lock, so the program cannot be unregistered and
+	 * its region freed before the exec is on the slice. */
+	mutex_lock(&user->lock);
+	ret = program_exec(user, launch.handle, launch.base_offset, &exec, &base);
+	if (!ret)
+		ret = slice_submit(user, &exec, &base, &seq);
+	mutex_unlock(&user->lock);
+	if (ret)
+		return ret;
+
+	if (launch.flags & VTA_LAUNCH_WAIT)
+		return exec_wait(user, &exec, seq, t_enter, ktime_get_ns());
+	if (copy_to_user(&((vta_launch_t __user *)arg)->seq, &seq, sizeof(seq)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+/* One entry of EXEC_BATCH and where it stands. */
+typedef struct {
+	vta_batch_entry_t e;
+	struct file *file;
+	vta_user_t *user;
+	vta_exec64_t exec;
+	u64 base;
+	bool own_base; /* run against base, not the user's base region */
+	u64 seq;
+	int state;
+	wait_queue_entry_t wait;
+} vta_batch_slot_t;
+
+enum { BATCH_PENDING, BATCH_RUNNING, BATCH_DONE };
+
+static bool batch_user_running(vta_batch_slot_t *slots, int n, vta_user_t *user) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (slots[i].state == BATCH_RUNNING && slots[i].user == user)
+			return true;
+	}
+	return false;
+}
+
+/* Start every pending entry whose dependencies are done. Returns the
+ * number of entries running afterwards. */
+static int batch_start(vta_batch_slot_t *slots, int n) {
+	vta_batch_slot_t *slot;
+	int i, j, running = 0;
+	long ret;
+
+	for (i = 0; i < n; i++) {
+		slot = &slots[i];
+		if (slot->state != BATCH_PENDING)
+			continue;
+		for (j = 0; j < i; j++) {
+			if (!(slot->e.deps & (1ULL << j)))
+				continue;
+			if (slots[j].state != BATCH_DONE)
+				break;
+			if (slots[j].e.result || slots[j].e.exec.status == VTA_STATUS_TIMEDOUT ||
+					slots[j].e.exec.status == VTA_STATUS_CANCELED) {
+				slot->e.result = -ECANCELED;
+				slot->state = BATCH_DONE;
+				break;
+			}
+		}
+		if (j < i)
+			continue;
+		ret = slice_submit(slot->user, &slot->exec, slot->own_base ? &slot->base : NULL,
+				&slot->seq);
+		/* A slice still busy with an earlier entry of the batch frees
+		 * up by itself; busy for any other reason it is an error. */
+		if (ret == -EBUSY && batch_user_running(slots, n, slot->user))
+			continue;
+		if (ret) {
+			slot->e.result = ret;
+			slot->state = BATCH_DONE;
+			continue;
+		}
+		slot->state = BATCH_RUNNING;
+	}
+	for (i = 0; i < n; i++)
+		running += slots[i].state == BATCH_RUNNING;
+	return running;
+}
+
+/* Retire the running entries that completed. Returns how many did. */
+static int batch_reap(vta_batch_slot_t *slots, int n) {
+	vta_batch_slot_t *slot;
+	vta_exec_rec_t rec;
+	int i, reaped = 0;
+
+	for (i = 0; i < n; i++) {
+		slot = &slots[i];
+		if (slot->state != BATCH_RUNNING || !seq_done(slot->user, slot->seq))
+			continue;
+		slot->state = BATCH_DONE;
+		if (seq_rec(slot->user, slot->seq, &rec)) {
+			slot->e.exec.status = rec.status;
+			slot->e.result = 0;
+			slice_account_exec(user_slice(slot->user), &rec);
+		} else {
+			slot->e.result = -ENOENT;
+		}
+		if (slot->seq > slot->user->reaped_seq)
+			slot->user->reaped_seq = slot->seq;
+		reaped++;
+	}
+	return reaped;
+}
+
+/* Sleep on the wait queues of all slices with a running entry until one
+ * of them completes. */
+static long batch_wait(vta_batch_slot_t *slots, int n) {
+	long ret = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (slots[i].state != BATCH_RUNNING)
+			continue;
+		init_waitqueue_entry(&slots[i].wait, current);
+		add_wait_queue(&user_slice(slots[i].user)->wq, &slots[i].wait);
+	}
+	for (;;) {
+		set_current_state(TASK_KILLABLE);
+		if (batch_reap(slots, n))
+			break;
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+	for (i = 0; i < n; i++) {
+		if (slots[i].wait.private) {
+			remove_wait_queue(&user_slice(slots[i].user)->wq, &slots[i].wait);
+			slots[i].wait.private = NULL;
+		}
+	}
+	return ret;
+}
+
+long device_exec_batch(struct file* filp, unsigned long long arg) {
+	vta_exec_batch_t batch;
+	vta_batch_slot_t *slots, *slot;
+	vta_batch_entry_t __user *uentries;
+	long ret = 0;
+	int i, n;
+
+	if (copy_from_user(&batch, (const void*)arg, sizeof(batch)) != 0)
+		return -EFAULT;
+	if (!batch.count || batch.count > VTA_BATCH_MAX)
+		return -EINVAL;
+	n = batch.count;
+	uentries = (vta_batch_entry_t __user *)batch.entries;
+	slots = kcalloc(n, sizeof(*slots), GFP_KERNEL);
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		slot = &slots[i];
+		if (copy_from_user(&slot->e, &uentries[i], sizeof(slot->e)) != 0) {
+			ret = -EFAULT;
+			goto out;
+		}
+		if (slot->e.deps >> i) {
+			ret = -EINVAL;
+			goto out;
+		}
+		exec_from_v1(&slot->exec, &slot->e.exec);
+		slot->e.result = 0;
+		if (slot->e.fd == -1) {
+			slot->file = get_file(filp);
+		} else {
+			slot->file = fget(slot->e.fd);
+			if (!slot->file) {
+				ret = -EBADF;
+				goto out;
+			}
+		}
+		if (slot->file->f_op != &fops) {
+			ret = -EINVAL;
+			goto out;
+		}
+		slot->user = slot->file->private_data;
+		if (slot->user->slice_idx == -1) {
+			slot->e.result = -EINVAL;
+			slot->state = BATCH_DONE;
+		}
+	}
+
+	while (batch_start(slots, n)) {
+		ret = batch_wait(slots, n);
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (copy_to_user(&uentries[i], &slots[i].e, sizeof(slots[i].e)) != 0) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+out:
+	for (i = 0; i < n; i++) {
+		if (slots[i].file)
+			fput(slots[i].file);
+	}
+	kfree(slots);
+	return ret;
+}
+
+/* Grow the gang of the fd to count slices, taking only slices that are
+ * free right now: waiting for several slices one at a time could
+ * deadlock two gangs against each other. */
+long device_gang_acquire(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_user_t *member;
+	vta_gang_t gang;
+	long ret = 0;
+
+	if (copy_from_user(&gang, (const void*)arg, sizeof(gang)) != 0)
+		return -EFAULT;
+	if (!gang.count || gang.count > VTA_GANG_MAX)
+		return -EINVAL;
+	mutex_lock(&user->lock);
+	if (user->slice_idx == -1)
+		ret = user_acquire_slice(user);
+	while (!ret && user->gang_extra + 1 < gang.count) {
+		member = kzalloc(sizeof(*member), GFP_KERNEL);
+		if (!member)
+			break;
+		user_init(member, user->dev);
+		if (user_acquire_slice(member)) {
+			kfree(member);
+			break;
+		}
+		/* Gang launches always pass the dram base explicitly. */
+		member->has_base = true;
+		member->owner = user;
+		/* SET_TIMEOUT covers the whole gang, members added later too. */
+		member->timeout_ns = user->timeout_ns;
+		user->gang[user->gang_extra++] = member;
+	}
+	gang.size = user->slice_idx == -1 ? 0 : user->gang_extra + 1;
+	mutex_unlock(&user->lock);
+	if (ret)
+		return ret;
+	if (copy_to_user((void __user *)arg, &gang, sizeof(gang)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+/* Run a program on the first count gang members at once, each against
+ * its own offset into the program's region, and wait for all of them. */
+long device_gang_launch(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_gang_launch_t launch;
+	vta_batch_slot_t *slots;
+	u64 offset;
+	long ret = 0;
+	int i, running;
+
+	if (copy_from_user(&launch, (const void*)arg, sizeof(launch)) != 0)
+		return -EFAULT;
+	if (!launch.count || launch.count > VTA_GANG_MAX)
+		return -EINVAL;
+	slots = kcalloc(launch.count, sizeof(*slots), GFP_KERNEL);
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < launch.count; i++) {
+		if (copy_from_user(&slots[i].base, (const void __user *)(launch.offsets + i * sizeof(u64)),
+					sizeof(u64)) != 0) {
+			ret = -EFAULT;
+			goto out;
+		}
+	}
+
+	mutex_lock(&user->lock);
+	if (user->slice_idx == -1 || launch.count > user->gang_extra + 1) {
+		mutex_unlock(&user->lock);
+		ret = -EINVAL;
+		goto out;
+	}
+	for (i = 0; i < launch.count; i++) {
+		offset = slots[i].base;
+		ret = program_exec(user, launch.handle, offset, &slots[i].exec, &slots[i].base);
+		if (ret)
+			break;
+		slots[i].own_base = true;
+		slots[i].user = i ? user->gang[i - 1] : user;
+	}
+	/* Members start together and complete in any order. Like LAUNCH,
+	 * they are submitted under the lock. */
+	running = ret ? 0 : batch_start(slots, launch.count);
+	mutex_unlock(&user->lock);
+	if (ret)
+		goto out;
+
+	while (running) {
+		ret = batch_wait(slots, launch.count);
+		if (ret)
+			goto out;
+		mutex_lock(&user->lock);
+		running = batch_start(slots, launch.count);
+		mutex_unlock(&user->lock);
+	}
+	for (i = 0; i < launch.count; i++) {
+		if (slots[i].e.result && !ret)
+			ret = slots[i].e.result;
+		if (launch.statuses && copy_to_user((void __user *)(launch.statuses + i * sizeof(u32)),
+					&slots[i].e.exec.status, sizeof(u32)) != 0)
+			ret = -EFAULT;
+	}
+out:
+	kfree(slots);
+	return ret;
+}
+
+/* Charge pages to the pinned_vm of mm, within RLIMIT_MEMLOCK unless the
+ * caller may lock any amount of memory. */
+static int pin_account(struct mm_struct *mm, unsigned long pages) {
+	unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	int ret = 0;
+
+	down_write(&mm->mmap_sem);
+	if (mm->pinned_vm + pages > limit && !capable(CAP_IPC_LOCK))
+		ret = -ENOMEM;
+	else
+		mm->pinned_vm += pages;
+	up_write(&mm->mmap_sem);
+	return ret;
+}
+
+static void pin_unaccount(struct mm_struct *mm, unsigned long pages) {
+	down_write(&mm->mmap_sem);
+	mm->pinned_vm -= pages;
+	up_write(&mm->mmap_sem);
+}
+
+/* Take a buffer off its fd. User lock held, or the file is going away. */
+static void pin_unlink(vta_user_t *user, vta_pin_buf_t *pin) {
+	list_del(&pin->node);
+	user->pinned_pages -= pin->nr_pages;
+}
+
+/* Unmap and unpin a buffer taken off its fd. Takes mmap_sem, so never
+ * under the user lock: the mmap paths take the two the other way round. */
+static void pin_free(vta_dev_t *dev, vta_pin_buf_t *pin) {
+	unsigned long i;
+
+	pin_unaccount(pin->mm, pin->nr_pages);
+	mmdrop(pin->mm);
+	dma_unmap_sg(&dev->pdev->dev, pin->sgt.sgl, pin->sgt.orig_nents, pin->dir);
+	sg_free_table(&pin->sgt);
+	for (i = 0; i < pin->nr_pages; i++) {
+		if (pin->dir != DMA_TO_DEVICE)
+			set_page_dirty_lock(pin->pages[i]);
+		put_page(pin->pages[i]);
+	}
+	kvfree(pin->pages);
+	kfree(pin);
+}
+
+long device_pin(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	struct device *dma_dev = &user->dev->pdev->dev;
+	vta_pin_t req;
+	vta_pin_seg_t seg;
+	vta_pin_buf_t *pin;
+	struct scatterlist *sg;
+	unsigned long offset, limit, i;
+	long pinned, ret;
+	int n;
+
+	if (copy_from_user(&req, (const void*)arg, sizeof(req)) != 0)
+		return -EFAULT;
+	if (!req.size || (req.flags & ~VTA_PIN_FLAGS_MASK) || req.addr + req.size < req.addr)
+		return -EINVAL;
+	offset = req.addr & ~PAGE_MASK;
+	limit = (unsigned long)READ_ONCE(max_pinned_mb) << (20 - PAGE_SHIFT);
+	if ((PAGE_ALIGN(offset + req.size) >> PAGE_SHIFT) > limit)
+		return -ENOMEM;
+	pin = kzalloc(sizeof(*pin), GFP_KERNEL);
+	if (!pin)
+		return -ENOMEM;
+	pin->nr_pages = PAGE_ALIGN(offset + req.size) >> PAGE_SHIFT;
+	pin->dir = (req.flags & VTA_PIN_DEVICE_WRITE) ? DMA_BIDIRECTIONAL : DMA_TO_DEVICE;
+	pin->pages = kvmalloc_array(pin->nr_pages, sizeof(struct page *), GFP_KERNEL);
+	if (!pin->pages) {
+		kfree(pin);
+		return -ENOMEM;
+	}
+	/* Pinned pages are locked memory of the caller, and stay charged to
+	 * its mm until they are unpinned, whoever closes the fd. */
+	ret = pin_account(current->mm, pin->nr_pages);
+	if (ret) {
+		kvfree(pin->pages);
+		kfree(pin);
+		return ret;
+	}
+	pin->mm = current->mm;
+	mmgrab(pin->mm);
+
+	/* Newer kernels want pin_user_pages() with FOLL_LONGTERM here, this
+	 * one only has the plain get_user_pages family. */
+	pinned = get_user_pages_fast(req.addr & PAGE_MASK, pin->nr_pages,
+			pin->dir != DMA_TO_DEVICE, pin->pages);
+	if (pinned != pin->nr_pages) {
+		ret = pinned < 0 ? pinned : -EFAULT;
+		pin->nr_pages = pinned < 0 ? 0 : pinned;
+		goto err_pages;
+	}
+	ret = sg_alloc_table_from_pages(&pin->sgt, pin->pages, pin->nr_pages,
+			offset, req.size, GFP_KERNEL);
+	if (ret)
+		goto err_pages;
+	pin->nents = dma_map_sg(dma_dev, pin->sgt.sgl, pin->sgt.orig_nents, pin->dir);
+	if (!pin->nents) {
+		ret = -EIO;
+		goto err_sgt;
+	}
+
+	mutex_lock(&user->lock);
+	if (user->pinned_pages + pin->nr_pages > limit) {
+		mutex_unlock(&user->lock);
+		ret = -ENOMEM;
+		goto err_map;
+	}
+	user->pinned_pages += pin->nr_pages;
+	pin->handle = ++user->next_pin;
+	list_add_tail(&pin->node, &user->pins);
+	mutex_unlock(&user->lock);
+
+	/* The buffer stays pinned if the copy out fails, close() frees it. */
+	req.handle = pin->handle;
+	req.nr_segs = pin->nents;
+	req.dma_addr = sg_dma_address(pin->sgt.sgl);
+	if (req.segs) {
+		for_each_sg(pin->sgt.sgl, sg, min_t(u32, pin->nents, req.max_segs), n) {
+			seg.dma_addr = sg_dma_address(sg);
+			seg.len = sg_dma_len(sg);
+			if (copy_to_user((void __user *)(req.segs + n * sizeof(seg)), &seg, sizeof(seg)))
+				return -EFAULT;
+		}
+	}
+	if (copy_to_user((void __user *)arg, &req, sizeof(req)) != 0)
+		return -EFAULT;
+	return 0;
+
+err_map:
+	dma_unmap_sg(dma_dev, pin->sgt.sgl, pin->sgt.orig_nents, pin->dir);
+err_sgt:
+	sg_free_table(&pin->sgt);
+err_pages:
+	for (i = 0; i < pin->nr_pages; i++)
+		put_page(pin->pages[i]);
+	pin_unaccount(pin->mm, PAGE_ALIGN(offset + req.size) >> PAGE_SHIFT);
+	mmdrop(pin->mm);
+	kvfree(pin->pages);
+	kfree(pin);
+	return ret;
+}
+
+long device_unpin(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_pin_buf_t *pin, *found = NULL;
+
+	mutex_lock(&user->lock);
+	list_for_each_entry(pin, &user->pins, node) {
+		if (pin->handle == arg) {
+			pin_unlink(user, pin);
+			found = pin;
+			break;
+		}
+	}
+	mutex_unlock(&user->lock);
+	if (!found)
+		return -ENOENT;
+	pin_free(user->dev, found);
+	return 0;
+}
+
+/* Hand a pinned buffer to the device after the CPU wrote it, or back to
+ * the CPU after the device wrote it. Without an IOMMU or bounce buffers
+ * these are no-ops, with swiotlb they copy the buffer. */
+long device_pin_sync(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	struct device *dma_dev = &user->dev->pdev->dev;
+	vta_pin_sync_t sync;
+	vta_pin_buf_t *pin;
+	long ret = -ENOENT;
+
+	if (copy_from_user(&sync, (const void*)arg, sizeof(sync)) != 0)
+		return -EFAULT;
+	if (sync.dir > VTA_SYNC_FOR_CPU)
+		return -EINVAL;
+	mutex_lock(&user->lock);
+	list_for_each_entry(pin, &user->pins, node) {
+		if (pin->handle != sync.handle)
+			continue;
+		if (sync.dir == VTA_SYNC_FOR_DEVICE)
+			dma_sync_sg_for_device(dma_dev, pin->sgt.sgl, pin->sgt.orig_nents, pin->dir);
+		else
+			dma_sync_sg_for_cpu(dma_dev, pin->sgt.sgl, pin->sgt.orig_nents, pin->dir);
+		ret = 0;
+		break;
+	}
+	mutex_unlock(&user->lock);
+	return ret;
+}
+
+/* Loads from a write-combining mapping are uncached, so memcpy_fromio()
+ * pays a bus round trip for every word. SSE4.1 streaming loads (MOVNTDQA)
+ * fetch a whole line into a streaming buffer and serve the rest of it from
+ * there, about a round trip per 64 bytes. Ends that are not whole lines,
+ * and CPUs without SSE4.1, go through memcpy_fromio(). */
+static void wc_memcpy_fromio(void *dst, const void __iomem *src, size_t n) {
+#ifdef CONFIG_X86_64
+	size_t head;
+
+	if (n >= 2 * 64 && boot_cpu_has(X86_FEATURE_XMM4_1) && irq_fpu_usable()) {
+		head = -(unsigned long)src & 63;
+		memcpy_fromio(dst, src, head);
+		dst += head;
+		src += head;
+		n -= head;
+		kernel_fpu_begin();
+		/* Streaming loads are weakly ordered against earlier ones. */
+		mb();
+		for (; n >= 64; n -= 64, src += 64, dst += 64)
+			asm volatile("movntdqa (%0), %%xmm0\n\t"
+				"movntdqa 16(%0), %%xmm1\n\t"
+				"movntdqa 32(%0), %%xmm2\n\t"
+				"movntdqa 48(%0), %%xmm3\n\t"
+				"movdqu %%xmm0, (%1)\n\t"
+				"movdqu %%xmm1, 16(%1)\n\t"
+				"movdqu %%xmm2, 32(%1)\n\t"
+				"movdqu %%xmm3, 48(%1)\n\t"
+				: : "r" (src), "r" (dst) : "memory");
+		kernel_fpu_end();
+	}
+#endif
+	memcpy_fromio(dst, src, n);
+}
+
+/* Move one request between its pinned pages and device dram. There is no
+ * copy engine on the device, so the worker streams through the kernel's
+ * write-combining mapping of BAR_RAM page by page: stores are combined by
+ * the mapping, loads use wc_memcpy_fromio(). */
+static void copy_run(vta_dev_t *dev, vta_copy_req_t *req) {
+	void __iomem *dram = dev->dram_kva + req->region->dram_base + req->offset;
+	unsigned int off = req->page_offset;
+	u64 done = 0, n;
+	unsigned long i;
+	void *kaddr;
+
+	for (i = 0; i < req->nr_pages && done < req->size; i++) {
+		n = min_t(u64, PAGE_SIZE - off, req->size - done);
+		kaddr = kmap(req->pages[i]);
+		if (req->dir == VTA_COPY_TO_DEVICE)
+			memcpy_toio(dram + done, kaddr + off, n);
+		else
+			wc_memcpy_fromio(kaddr + off, dram + done, n);
+		kunmap(req->pages[i]);
+		done += n;
+		off = 0;
+		cond_resched();
+	}
+	if (req->dir == VTA_COPY_TO_DEVICE)
+		wmb();
+}
+
+static void copy_req_free(vta_user_t *user, vta_copy_req_t *req) {
+	unsigned long i;
+
+	for (i = 0; i < req->nr_pages; i++) {
+		if (req->dir == VTA_COPY_FROM_DEVICE)
+			set_page_dirty_lock(req->pages[i]);
+		put_page(req->pages[i]);
+	}
+	kvfree(req->pages);
+	if (req->region) {
+		mutex_lock(&user->lock);
+		region_put(user, req->region);
+		mutex_unlock(&user->lock);
+	}
+	kfree(req);
+}
+
+static void copy_work_fn(struct work_struct *work) {
+	vta_user_t *user = container_of(work, vta_user_t, copy_work);
+	vta_slice_t *slice = user_slice(user);
+	vta_copy_req_t *req;
+	unsigned long flags;
+
+	for (;;) {
+		spin_lock(&user->copy_lock);
+		req = list_first_entry_or_null(&user->copies, vta_copy_req_t, node);
+		if (req)
+			list_del(&req->node);
+		spin_unlock(&user->copy_lock);
+		if (!req)
+			break;
+		copy_run(user->dev, req);
+		copy_req_free(user, req);
+
+		spin_lock_irqsave(&slice->lock, flags);
+		user->copy_done_seq++;
+		if (user->evfd)
+			eventfd_signal(user->evfd, 1);
+		spin_unlock_irqrestore(&slice->lock, flags);
+		wake_up(&slice->wq);
+	}
+}
+
+/* Queue one copy for the worker; its sequence number goes to cp->seq. */
+static long copy_submit(vta_user_t *user, vta_copy_t *cp) {
+	vta_copy_req_t *req;
+	vta_region_t *region;
+	long pinned;
+
+	if (!cp->size || cp->dir > VTA_COPY_FROM_DEVICE || cp->addr + cp->size < cp->addr)
+		return -EINVAL;
+	if (!user->dev->dram_kva)
+		return -ENODEV;
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+	req->offset = cp->offset;
+	req->size = cp->size;
+	req->dir = cp->dir;
+	req->page_offset = cp->addr & ~PAGE_MASK;
+	req->nr_pages = PAGE_ALIGN(req->page_offset + cp->size) >> PAGE_SHIFT;
+	req->pages = kvmalloc_array(req->nr_pages, sizeof(struct page *), GFP_KERNEL);
+	if (!req->pages) {
+		kfree(req);
+		return -ENOMEM;
+	}
+	/* The worker cannot touch the caller's address space, pin it now. */
+	pinned = get_user_pages_fast(cp->addr & PAGE_MASK, req->nr_pages,
+			cp->dir == VTA_COPY_FROM_DEVICE, req->pages);
+	if (pinned != req->nr_pages) {
+		req->nr_pages = pinned < 0 ? 0 : pinned;
+		copy_req_free(user, req);
+		return pinned < 0 ? pinned : -EFAULT;
+	}
+
+	/* Hold the region so munmap() cannot hand its dram to someone else
+	 * while the copy is queued. */
+	mutex_lock(&user->lock);
+	region = user_find_region(user, cp->region >> PAGE_SHIFT);
+	if (!region || cp->offset > region_size(region) ||
+			cp->size > region_size(region) - cp->offset) {
+		mutex_unlock(&user->lock);
+		copy_req_free(user, req);
+		return region ? -EINVAL : -ENOENT;
+	}
+	region->maps++;
+	req->region = region;
+	mutex_unlock(&user->lock);
+
+	spin_lock(&user->copy_lock);
+	list_add_tail(&req->node, &user->copies);
+	cp->seq = ++user->copy_submit_seq;
+	spin_unlock(&user->copy_lock);
+	queue_work(system_unbound_wq, &user->copy_work);
+	return 0;
+}
+
+long device_copy(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_copy_t cp;
+	long ret;
+
+	if (copy_from_user(&cp, (const void*)arg, sizeof(cp)) != 0)
+		return -EFAULT;
+	ret = copy_submit(user, &cp);
+	if (ret)
+		return ret;
+	if (copy_to_user(&((vta_copy_t __user *)arg)->seq, &cp.seq, sizeof(cp.seq)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+/* The doorbell: pick up everything user space queued since the last kick. */
+long device_ring_kick(struct file* filp, unsigned long long arg) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_slice_t *slice;
+	unsigned long flags;
+	u32 tail, queued;
+	u64 seq;
+
+	if (user->slice_idx == -1)
+		return -EINVAL;
+	slice = user_slice(user);
+	spin_lock_irqsave(&slice->lock, flags);
+	if (!user->ring) {
+		spin_unlock_irqrestore(&slice->lock, flags);
+		return -EINVAL;
+	}
+	if (user->ctrl_maps) {
+		spin_unlock_irqrestore(&slice->lock, flags);
+		return -EBUSY;
+	}
+	tail = ioread32(&user->ring->tail);
+	queued = tail - user->ring_tail;
+	if (tail - user->ring_head > user->ring_mask + 1) {
+		spin_unlock_irqrestore(&slice->lock, flags);
+		return -EOVERFLOW;
+	}
+	user->ring_tail = tail;
+	user->ring_kick_ns = ktime_get_ns();
+	user->submit_seq += queued;
+	seq = user->submit_seq;
+	if (!user->busy)
+		ring_start_next(user);
+	spin_unlock_irqrestore(&slice->lock, flags);
+
+	if (arg && copy_to_user((void __user *)arg, &seq, sizeof(seq)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+/* Whether slice_submit() would take another exec right now. */
+static bool slice_can_submit(vta_user_t *user) {
+	slice_complete(user_slice(user));
+	if (READ_ONCE(user->ctrl_maps))
+		return false;
+	if (!READ_ONCE(user->busy))
+		return true;
+	return READ_ONCE(user->ctx_tail) - READ_ONCE(user->ctx_head) + 1 < READ_ONCE(user->nr_contexts) &&
+		!READ_ONCE(user->ring_running);
+}
+
+/* pwrite() at VTA_WRITE_COPY: queue an array of vta_copy_t. Copies never
+ * wait for room, so this does not block. */
+static ssize_t vta_write_copies(vta_user_t *user, const char __user *buf, size_t count) {
+	vta_copy_t cp;
+	size_t done = 0;
+	long ret = 0;
+
+	if (count % sizeof(cp))
+		return -EINVAL;
+	while (done < count) {
+		if (copy_from_user(&cp, buf + done, sizeof(cp)) != 0) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = copy_submit(user, &cp);
+		if (ret)
+			break;
+		done += sizeof(cp);
+	}
+	return done ? done : ret;
+}
+
+static ssize_t vta_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_slice_t *slice;
+	vta_exec_t entry;
+	vta_exec64_t exec;
+	size_t done = 0;
+	u64 seq;
+	long ret = 0;
+
+	if (user->slice_idx == -1)
+		return -EINVAL;
+	if (*ppos == VTA_WRITE_COPY)
+		return vta_write_copies(user, buf, count);
+	if (count % sizeof(entry))
+		return -EINVAL;
+	if (READ_ONCE(user->ctrl_maps))
+		return -EBUSY;
+	slice = user_slice(user);
+	while (done < count) {
+		if (copy_from_user(&entry, buf + done, sizeof(entry)) != 0) {
+			ret = -EFAULT;
+			break;
+		}
+		exec_from_v1(&exec, &entry);
+		ret = slice_submit(user, &exec, NULL, &seq);
+		if (ret == -EBUSY && !done && !(filp->f_flags & O_NONBLOCK)) {
+			ret = wait_event_interruptible(slice->wq, slice_can_submit(user));
+			if (ret)
+				break;
+			continue;
+		}
+		if (ret)
+			break;
+		done += sizeof(entry);
+	}
+	if (done)
+		return done;
+	return ret == -EBUSY ? -EAGAIN : ret;
+}
+
+/* Whether read() has an exec or copy completion to return. */
+static bool read_ready(vta_user_t *user) {
+	return seq_done(user, user->reaped_seq + 1) ||
+		READ_ONCE(user->copy_done_seq) > user->copy_reaped_seq;
+}
+
+/* Exec completions first, then copy completions. */
+static ssize_t vta_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_completion_t comp;
+	vta_exec_rec_t rec;
+	vta_slice_t *slice;
+	size_t done = 0;
+	long ret;
+
+	if (user->slice_idx == -1)
+		return -EINVAL;
+	if (count < sizeof(comp))
+		return -EINVAL;
+	slice = user_slice(user);
+	if (!read_ready(user)) {
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(slice->wq, read_ready(user));
+		if (ret)
+			return ret;
+	}
+	while (done + sizeof(comp) <= count && user->reaped_seq < READ_ONCE(user->done_seq)) {
+		memset(&comp, 0, sizeof(comp));
+		comp.seq = user->reaped_seq + 1;
+		if (seq_rec(user, comp.seq, &rec))
+			comp.status = rec.status;
+		else
+			comp.flags = VTA_COMPLETION_LOST;
+		if (copy_to_user(buf + done, &comp, sizeof(comp)) != 0)
+			return done ? done : -EFAULT;
+		user->reaped_seq = comp.seq;
+		done += sizeof(comp);
+	}
+	while (done + sizeof(comp) <= count && user->copy_reaped_seq < READ_ONCE(user->copy_done_seq)) {
+		memset(&comp, 0, sizeof(comp));
+		comp.seq = user->copy_reaped_seq + 1;
+		comp.flags = VTA_COMPLETION_COPY;
+		if (copy_to_user(buf + done, &comp, sizeof(comp)) != 0)
+			return done ? done : -EFAULT;
+		user->copy_reaped_seq = comp.seq;
+		done += sizeof(comp);
+	}
+	return done;
+}
+
+/* Readable once an exec or copy completed that no WAIT, EXEC or read()
+ * has reaped yet, writable while the slice accepts another exec. */
+static unsigned int vta_poll(struct file *filp, poll_table *wait) {
+	vta_user_t *user = (vta_user_t*) (filp->private_data);
+	vta_slice_t *slice;
+	unsigned int mask = 0;
+
+	if (user->slice_idx == -1)
+		return POLLERR;
+	slice = user_slice(user);
+	poll_wait(filp, &slice->wq, wait);
+	slice_complete(slice);
+	if (READ_ONCE(user->done_seq) > user->reaped_seq ||
+			READ_ONCE(user->copy_done_seq) > user->copy_reaped_seq)
+		mask |= POLLIN | POLLRDNORM;
+	if (slice_can_submit(user))
+		mask |= POLLOUT | POLLWRNORM;
+	return mask;
+}
+
+static long vta_ioctl (struct file *file, unsigned int cmd, unsigned long arg) {
+    printk(KERN_DEBUG "Entering: %s\n", __func__);
+    switch (cmd) {
+        case IOCTL_TVM_VTA_CMD_EXEC:
+			return device_exec(file, arg);
+        case IOCTL_TVM_VTA_CMD_SUBMIT:
+			return device_submit(file, arg);
+        case IOCTL_TVM_VTA_CMD_WAIT:
+			return device_wait(file, arg);
+        case IOCTL_TVM_VTA_CMD_SET_EVENTFD:
+			return device_set_eventfd(file, arg);
+        case IOCTL_TVM_VTA_CMD_RING_SETUP:
+			return device_ring_setup(file, arg);
+        case IOCTL_TVM_VTA_CMD_RING_KICK:
+			return device_ring_kick(file, arg);
+        case IOCTL_TVM_VTA_CMD_REGION_INFO:
+			return device_region_info(file, arg);
+        case IOCTL_TVM_VTA_CMD_SET_BASE:
+			return device_set_base(file, arg);
+        case IOCTL_TVM_VTA_CMD_SET_MAP_FLAGS:
+			return device_set_map_flags(file, arg);
+        case IOCTL_TVM_VTA_CMD_ACQUIRE:
+			return device_acquire(file, arg);
+        case IOCTL_TVM_VTA_CMD_PIN:
+			return device_pin(file, arg);
+        case IOCTL_TVM_VTA_CMD_UNPIN:
+			return device_unpin(file, arg);
+        case IOCTL_TVM_VTA_CMD_COPY:
+			return device_copy(file, arg);
+        case IOCTL_TVM_VTA_CMD_EXEC64:
+			return device_exec64(file, arg);
+        case IOCTL_TVM_VTA_CMD_SUBMIT64:
+			return device_submit64(file, arg);
+        case IOCTL_TVM_VTA_CMD_REGISTER_PROGRAM:
+			return device_register_program(file, arg);
+        case IOCTL_TVM_VTA_CMD_LAUNCH:
+			return device_launch(file, arg);
+        case IOCTL_TVM_VTA_CMD_UNREGISTER_PROGRAM:
+			return device_unregister_program(file, arg);
+        case IOCTL_TVM_VTA_CMD_SET_CONTEXTS:
+			return device_set_contexts(file, arg);
+        case IOCTL_TVM_VTA_CMD_EXEC_BATCH:
+			return device_exec_batch(file, arg);
+        case IOCTL_TVM_VTA_CMD_GANG_ACQUIRE:
+			return device_gang_acquire(file, arg);
+        case IOCTL_TVM_VTA_CMD_GANG_LAUNCH:
+			return device_gang_launch(file, arg);
+        case IOCTL_TVM_VTA_CMD_EXEC_TIMES:
+			return device_exec_times(file, arg);
+        case IOCTL_TVM_VTA_CMD_SET_TIMEOUT:
+			return device_set_timeout(file, arg);
+        case IOCTL_TVM_VTA_CMD_CANCEL:
+			return device_cancel(file, arg);
+        case IOCTL_TVM_VTA_CMD_SYNC:
+			return device_sync(file, arg);
+        case IOCTL_TVM_VTA_CMD_PIN_SYNC:
+			return device_pin_sync(file, arg);
+        default:                                    break;
+    }
+    return 0;
+}
+
+/* read() and write() carry exec completions and submissions, see
+ * vta_completion_t. Everything else goes through ioctls. */
+static struct file_operations fops = {
+	.owner   = THIS_MODULE,
+	.mmap	 = vta_mmap,
+	.open	 = vta_open,
+	.release = vta_close,
+	.read    = vta_read,
+	.write   = vta_write,
+	.poll    = vta_poll,
+	.unlocked_ioctl = vta_ioctl
+};
+
+static ssize_t spin_budget_ns_show(struct class *class, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", spin_budget_ns);
+}
+
+static ssize_t spin_budget_ns_store(struct class *class, struct class_attribute *attr,
+		const char *buf, size_t count)
+{
+	unsigned int val;
+	if (kstrtouint(buf, 0, &val))
+		return -EINVAL;
+	WRITE_ONCE(spin_budget_ns, val);
+	return count;
+}
+static CLASS_ATTR_RW(spin_budget_ns);
+
+static ssize_t spin_adaptive_show(struct class *class, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", spin_adaptive);
+}
+
+static ssize_t spin_adaptive_store(struct class *class, struct class_attribute *attr,
+		const char *buf, size_t count)
+{
+	bool val;
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+	WRITE_ONCE(spin_adaptive, val);
+	return count;
+}
+static CLASS_ATTR_RW(spin_adaptive);
+
+static struct class_attribute *vta_class_attrs[] = {
+	&class_attr_spin_budget_ns,
+	&class_attr_spin_adaptive,
+};
+
+/* One line per slice: how blocking execs waited and the current budget. */
+static ssize_t exec_paths_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	vta_dev_t *dev = dev_get_drvdata(device);
+	vta_slice_t *slice;
+	ssize_t len = 0;
+	int i;
+	for (i = 0; i < dev->total_slice; i++) {
+		slice = &dev->slices[i];
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				"slice%d spin %lld sleep %lld avg_ns %llu budget_ns %llu\n", i,
+				(long long)atomic64_read(&slice->spin_hits),
+				(long long)atomic64_read(&slice->sleeps),
+				slice->avg_exec_ns, slice_spin_budget(slice));
+	}
+	return len;
+}
+static DEVICE_ATTR_RO(exec_paths);
+
+/* Occupancy of device DRAM: the largest free block bounds the next mmap. */
+static ssize_t dram_info_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	vta_dev_t *dev = dev_get_drvdata(device);
+	vta_buddy_t *b = &dev->dram_buddy;
+	unsigned long free_pages, largest;
+	unsigned int regions;
+
+	mutex_lock(&b->lock);
+	free_pages = b->free_pages;
+	largest = b->longest[0] ? 1UL << (b->longest[0] - 1) : 0;
+	regions = b->regions;
+	mutex_unlock(&b->lock);
+	return sprintf(buf, "total %lu free %lu largest %lu regions %u slices %d inflight %d\n",
+			(1UL << b->max_order) << PAGE_SHIFT, free_pages << PAGE_SHIFT,
+			largest << PAGE_SHIFT, regions, dev->total_slice,
+			atomic_read(&dev->inflight));
+}
+static DEVICE_ATTR_RO(dram_info);
+
+/* Admission queue: current and peak depth, how long ACQUIRE waited. */
+static ssize_t admission_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	vta_dev_t *dev = dev_get_drvdata(device);
+	unsigned int depth, max_depth;
+	u64 waits, timeouts, wait_ns, wait_max_ns;
+
+	spin_lock(&dev->admit_lock);
+	depth = dev->admit_depth;
+	max_depth = dev->admit_max_depth;
+	waits = dev->admit_waits;
+	timeouts = dev->admit_timeouts;
+	wait_ns = dev->admit_wait_ns;
+	wait_max_ns = dev->admit_wait_max_ns;
+	spin_unlock(&dev->admit_lock);
+	return sprintf(buf, "depth %u max_depth %u waits %llu timeouts %llu avg_wait_ns %llu max_wait_ns %llu\n",
+			depth, max_depth, waits, timeouts,
+			waits ? div64_u64(wait_ns, waits) : 0, wait_max_ns);
+}
+static DEVICE_ATTR_RO(admission);
+
+/* Exec counters per slice, then summed over the device. */
+static ssize_t stats_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	vta_dev_t *dev = dev_get_drvdata(device);
+	vta_slice_stats_t st, total;
+	unsigned long flags;
+	ssize_t len = 0;
+	int i;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < dev->total_slice; i++) {
+		spin_lock_irqsave(&dev->slices[i].lock, flags);
+		st = dev->slices[i].stats;
+		spin_unlock_irqrestore(&dev->slices[i].lock, flags);
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				"slice%d execs %llu busy_ns %llu max_busy_ns %llu insns %llu wait_cycles %llu timeouts %llu\n",
+				i, st.execs, st.busy_ns, st.max_busy_ns, st.insns, st.wait_cycles, st.timeouts);
+		total.execs += st.execs;
+		total.busy_ns += st.busy_ns;
+		total.max_busy_ns = max(total.max_busy_ns, st.max_busy_ns);
+		total.insns += st.insns;
+		total.wait_cycles += st.wait_cycles;
+		total.timeouts += st.timeouts;
+	}
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+			"total execs %llu busy_ns %llu max_busy_ns %llu insns %llu wait_cycles %llu timeouts %llu\n",
+			total.execs, total.busy_ns, total.max_busy_ns, total.insns, total.wait_cycles,
+			total.timeouts);
+	return len;
+}
+static DEVICE_ATTR_RO(stats);
+
+/* Exec latency of the device as "<from_us> <count>" per log2 bucket. */
+static ssize_t latency_hist_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	vta_dev_t *dev = dev_get_drvdata(device);
+	u64 hist[VTA_HIST_BUCKETS] = { 0 };
+	unsigned long flags;
+	ssize_t len = 0;
+	int i, b;
+
+	for (i = 0; i < dev->total_slice; i++) {
+		spin_lock_irqsave(&dev->slices[i].lock, flags);
+		for (b = 0; b < VTA_HIST_BUCKETS; b++)
+			hist[b] += dev->slices[i].stats.hist[b];
+		spin_unlock_irqrestore(&dev->slices[i].lock, flags);
+	}
+	for (b = 0; b < VTA_HIST_BUCKETS; b++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%lu %llu\n",
+				b ? 1UL << b : 0, hist[b]);
+	return len;
+}
+static DEVICE_ATTR_RO(latency_hist);
+
+/* Writing anything clears the exec counters, the exec path counts and the
+ * admission wait statistics. */
+static ssize_t stats_reset_store(struct device *device, struct device_attribute *attr,
+		const char *buf, size_t count)
+{
+	vta_dev_t *dev = dev_get_drvdata(device);
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < dev->total_slice; i++) {
+		spin_lock_irqsave(&dev->slices[i].lock, flags);
+		memset(&dev->slices[i].stats, 0, sizeof(dev->slices[i].stats));
+		spin_unlock_irqrestore(&dev->slices[i].lock, flags);
+		atomic64_set(&dev->slices[i].spin_hits, 0);
+		atomic64_set(&dev->slices[i].sleeps, 0);
+	}
+	spin_lock(&dev->admit_lock);
+	dev->admit_max_depth = dev->admit_depth;
+	dev->admit_waits = 0;
+	dev->admit_timeouts = 0;
+	dev->admit_wait_ns = 0;
+	dev->admit_wait_max_ns = 0;
+	spin_unlock(&dev->admit_lock);
+	return count;
+}
+static DEVICE_ATTR_WO(stats_reset);
+
+/* Irq of each slice, for pinning completions via /proc/irq/N/smp_affinity. */
+static ssize_t irqs_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	vta_dev_t *dev = dev_get_drvdata(device);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < dev->total_slice; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "slice%d irq %d\n", i,
+				dev->irq_per_slice ? dev->slices[i].irq : dev->pci_irq);
+	return len;
+}
+static DEVICE_ATTR_RO(irqs);
+
+static struct attribute *vta_dev_attrs[] = {
+	&dev_attr_exec_paths.attr,
+	&dev_attr_dram_info.attr,
+	&dev_attr_admission.attr,
+	&dev_attr_irqs.attr,
+	&dev_attr_stats.attr,
+	&dev_attr_latency_hist.attr,
+	&dev_attr_stats_reset.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(vta_dev);
+
+/* MSI-X vector of one slice: nobody else raises it, so no status read. */
+static irqreturn_t slice_irq_handler(int irq, void *dev_id)
+{
+	vta_slice_t *slice = dev_id;
+
+	iowrite32(1u << slice->idx, slice->dev->mmio + IO_IRQ_ACK);
+	if (slice_complete(slice))
+		wake_up(&slice->wq);
+	return IRQ_HANDLED;
+}
+
+static irqreturn_t irq_handler(int irq, void *dev_id)
+{
+	vta_dev_t *dev = dev_id;
+	bool done = false;
+	int i;
+	u32 irq_status;
+
+	irq_status = ioread32(dev->mmio + IO_IRQ_STATUS);
+	pr_debug("interrupt irq = %d dev = %d irq_status = %llx\n",
+			irq, dev->minor, (unsigned long long)irq_status);
+	/* Must do this ACK, or else the interrupts just keeps firing. The
+	 * value read may be 0 even when a slice finished, see vta_slice_t. */
+	iowrite32(irq_status, dev->mmio + IO_IRQ_ACK);
+	for (i = 0; i < dev->total_slice; i++) {
+		if (slice_complete(&dev->slices[i])) {
+			wake_up(&dev->slices[i].wq);
+			done = true;
+		}
+	}
+	return IRQ_RETVAL(irq_status || done);
+}
+
+/* Stop execs that ran past their deadline, so a bad instruction stream
+ * cannot hold a slice forever. Whatever is queued behind starts next. */
+static void watchdog_fn(struct work_struct *work)
+{
+	vta_dev_t *dev = container_of(to_delayed_work(work), vta_dev_t, watchdog);
+	vta_slice_t *slice;
+	vta_user_t *user;
+	unsigned long flags;
+	bool expired;
+	u64 now;
+	int i;
+
+	for (i = 0; i < dev->total_slice; i++) {
+		slice = &dev->slices[i];
+		/* Execs that did finish are not timed out late. */
+		slice_complete(slice);
+		now = ktime_get_ns();
+		spin_lock_irqsave(&slice->lock, flags);
+		user = slice->user;
+		expired = user && user->busy && user->deadline_ns && now > user->deadline_ns;
+		if (expired) {
+			slice->stats.timeouts++;
+			slice_abort(slice, user, VTA_STATUS_TIMEDOUT, false);
+		}
+		spin_unlock_irqrestore(&slice->lock, flags);
+		if (expired) {
+			dev_warn(&dev->pdev->dev, "slice %d exec timed out\n", i);
+			wake_up(&slice->wq);
+		}
+	}
+	queue_delayed_work(system_wq, &dev->watchdog, msecs_to_jiffies(max(watchdog_ms, 1U)));
+}
+
+/* One MSI-X vector per slice, spread over the CPUs near the device; the
+ * affinity stays writable in /proc/irq/N/smp_affinity. Falls back to a
+ * single MSI or legacy irq shared by all slices. */
+static int vta_request_irqs(vta_dev_t *dev)
+{
+	struct pci_dev *pdev = dev->pdev;
+	int i, ret, cpu;
+
+	if (msix && pci_alloc_irq_vectors(pdev, dev->total_slice, dev->total_slice,
+				PCI_IRQ_MSIX) == dev->total_slice) {
+		for (i = 0; i < dev->total_slice; i++) {
+			dev->slices[i].irq = pci_irq_vector(pdev, i);
+			ret = request_irq(dev->slices[i].irq, slice_irq_handler, 0,
+					"vta_slice", &dev->slices[i]);
+			if (ret) {
+				dev->slices[i].irq = 0;
+				goto unwind;
+			}
+			cpu = cpumask_local_spread(i, dev_to_node(&pdev->dev));
+			irq_set_affinity_hint(dev->slices[i].irq, cpumask_of(cpu));
+		}
+		dev->irq_per_slice = true;
+		dev->pci_irq = dev->slices[0].irq;
+		return 0;
+unwind:
+		while (--i >= 0) {
+			irq_set_affinity_hint(dev->slices[i].irq, NULL);
+			free_irq(dev->slices[i].irq, &dev->slices[i]);
+			dev->slices[i].irq = 0;
+		}
+		pci_free_irq_vectors(pdev);
+	}
+
+	ret = pci_alloc_irq_vectors(pdev, 1, 1, PCI_IRQ_MSI | PCI_IRQ_LEGACY);
+	if (ret < 0)
+		return ret;
+	dev->pci_irq = pci_irq_vector(pdev, 0);
+	ret = request_irq(dev->pci_irq, irq_handler, IRQF_SHARED, "pci_irq_handler0", dev);
+	if (ret) {
+		pci_free_irq_vectors(pdev);
+		return ret;
+	}
+	return 0;
+}
+
+static void vta_free_irqs(vta_dev_t *dev)
+{
+	int i;
+
+	if (dev->irq_per_slice) {
+		for (i = 0; i < dev->total_slice; i++) {
+			irq_set_affinity_hint(dev->slices[i].irq, NULL);
+			free_irq(dev->slices[i].irq, &dev->slices[i]);
+		}
+	} else {
+		free_irq(dev->pci_irq, dev);
+	}
+	pci_free_irq_vectors(dev->pdev);
+}
+
+/* Last reference gone: the device was removed and no file uses it. */
+static void vta_dev_release(struct kref *ref)
+{
+	vta_dev_t *dev = container_of(ref, vta_dev_t, ref);
+	struct pci_dev *pdev = dev->pdev;
+
+	vfree(dev->trace);
+	if (dev->dram_kva)
+		iounmap(dev->dram_kva);
+	kfree(dev->slices);
+	kfree((void *)dev->slice_used);
+	buddy_destroy(&dev->dram_buddy);
+	if (dev->wc_reserved)
+		arch_io_free_memtype_wc(pci_resource_start(pdev, BAR_RAM),
+				pci_resource_len(pdev, BAR_RAM));
+	if (dev->mmio) {
+		pci_iounmap(pdev, dev->mmio);
+		pci_release_region(pdev, BAR);
+	}
+	pci_dev_put(pdev);
+	kfree(dev);
+}
+
+/**
+ * Called just after insmod if the hardware device is connected,
+ * not called otherwise.
+ *
+ * 0: all good
+ * <0: failed
+ */
+static int pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
+{
+	vta_dev_t *dev;
+	u64 dram_size;
+	unsigned long slices;
+	u8 val;
+	int i, ret = -ENOMEM;
+
+	pr_info("pci_probe\n");
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		return -ENOMEM;
+	kref_init(&dev->ref);
+	dev->pdev = pci_dev_get(pdev);
+	pci_set_drvdata(pdev, dev);
+
+	mutex_lock(&vta_devs_lock);
+	for (i = 0; i < VTA_MAX_DEVS && vta_devs[i]; i++)
+		;
+	dev->minor = i;
+	mutex_unlock(&vta_devs_lock);
+	if (dev->minor == VTA_MAX_DEVS) {
+		dev_err(&(pdev->dev), "too many devices\n");
+		ret = -ENOSPC;
+		goto error;
+	}
+
+	pci_read_config_byte(pdev, PCI_INTERRUPT_LINE, &val);
+	pr_info("irq pre %x\n", val);
+	if (pci_enable_device(pdev) < 0) {
+		dev_err(&(pdev->dev), "pci_enable_device\n");
+		ret = -ENODEV;
+		goto error;
+	}
+
+	/* Pinned host buffers above 4 GiB would need bounce buffers on a
+	 * 32-bit device. */
+	dev->addr64 = addr64 && !dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64));
+	if (!dev->addr64)
+		dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32));
+	dev->cycle_counter = cycle_counter;
+	dev->slice_reset = slice_reset;
+	dev->ctrl_size = dev->addr64 || dev->cycle_counter ? VTA_SLICE_CTRL_SIZE64 : VTA_SLICE_CTRL_SIZE;
+	dev->ctrl_paged = ctrl_paged && PAGE_ALIGNED(pci_resource_start(pdev, BAR)) &&
+		pci_resource_len(pdev, BAR) >= 3 * PAGE_SIZE;
+	dev->ctrl_stride = dev->ctrl_paged ? 2 * PAGE_SIZE : dev->ctrl_size;
+	dev->ctrl_offset = dev->ctrl_paged ? PAGE_SIZE : 0;
+	dev->ctrl_base_offset = dev->ctrl_paged ? PAGE_SIZE : 0;
+	pci_set_master(pdev);
+	if (pci_request_region(pdev, BAR, "myregion0")) {
+		dev_err(&(pdev->dev), "pci_request_region\n");
+		ret = -EBUSY;
+		goto error;
+	}
+	dev->mmio = pci_iomap(pdev, BAR, pci_resource_len(pdev, BAR));
+	if (!dev->mmio) {
+		pci_release_region(pdev, BAR);
+		goto error;
+	}
+	dev->ctrl_mmio = dev->mmio + dev->ctrl_offset;
+	dev->pfn_dev_mem = __phys_to_pfn(pci_resource_start(pdev, BAR_RAM));
+	/* Lazily inserted pfns take their cache mode from the memtype of the
+	 * range, reserve it as write-combining like io_remap_pfn_range()
+	 * would for each mapping. */
+	dev->wc_reserved = !arch_io_reserve_memtype_wc(pci_resource_start(pdev, BAR_RAM),
+			pci_resource_len(pdev, BAR_RAM));
+	if (!dev->wc_reserved)
+		pr_info("bar 1 memtype reservation failed\n");
+	dev->dram_kva = ioremap_wc(pci_resource_start(pdev, BAR_RAM),
+			pci_resource_len(pdev, BAR_RAM));
+	if (!dev->dram_kva)
+		pr_info("bar 1 not mapped, no bulk copies\n");
+
+	pr_info("bar 0 size %llx\n", pci_resource_len(pdev, BAR));
+	pr_info("bar 1 size %llx\n", pci_resource_len(pdev, BAR_RAM));
+
+	/* A 32-bit device cannot address dram past 4 GiB, keep it out of the
+	 * allocator. */
+	dram_size = pci_resource_len(pdev, BAR_RAM);
+	if (!dev->addr64)
+		dram_size = min_t(u64, dram_size, 1ULL << 32);
+	if (buddy_init(&dev->dram_buddy, dram_size >> PAGE_SHIFT))
+		goto error;
+	slices = max_t(unsigned long, pci_resource_len(pdev, BAR_RAM) / VTA_DRAM_PER_SLICE, 1);
+	/* Packed blocks start at BAR0 offset 0 and share the page with
+	 * IO_IRQ_STATUS and IO_IRQ_ACK. Slice 1 covers IO_IRQ_STATUS by the
+	 * device's own layout, which irq_handler() copes with; extra blocks
+	 * must not reach the ack register, or acking an interrupt would
+	 * rewrite one. */
+	if (nr_slices > slices && !dev->ctrl_paged)
+		slices = max_t(unsigned long, slices, min_t(unsigned long, nr_slices,
+					IO_IRQ_ACK / dev->ctrl_stride));
+	else if (nr_slices)
+		slices = nr_slices;
+	if (nr_slices && slices != nr_slices)
+		dev_warn(&pdev->dev, "nr_slices %u overlaps the irq registers, using %lu\n",
+				nr_slices, slices);
+	dev->total_slice = min_t(unsigned long, min_t(unsigned long, slices, VTA_MAX_SLICES),
+			(pci_resource_len(pdev, BAR) - dev->ctrl_offset) / dev->ctrl_stride);
+	dev->slice_used = kcalloc(dev->total_slice, sizeof(volatile int), GFP_KERNEL);
+	dev->slices = kcalloc(dev->total_slice, sizeof(vta_slice_t), GFP_KERNEL);
+	if (!dev->slice_used || !dev->slices)
+		goto error;
+	for (i = 0; i < dev->total_slice; i++) {
+		init_waitqueue_head(&dev->slices[i].wq);
+		spin_lock_init(&dev->slices[i].lock);
+		dev->slices[i].dev = dev;
+		dev->slices[i].idx = i;
+		atomic64_set(&dev->slices[i].spin_hits, 0);
+		atomic64_set(&dev->slices[i].sleeps, 0);
+	}
+	atomic_set(&dev->tenants, 0);
+	atomic_set(&dev->inflight, 0);
+	atomic_long_set(&dev->cached_pages, 0);
+	spin_lock_init(&dev->admit_lock);
+	INIT_LIST_HEAD(&dev->admit_list);
+	init_waitqueue_head(&dev->admit_wq);
+	INIT_DELAYED_WORK(&dev->watchdog, watchdog_fn);
+
+	if (trace_entries) {
+		unsigned long entries = roundup_pow_of_two(min(trace_entries, VTA_TRACE_MAX_ENTRIES));
+
+		dev->trace_size = PAGE_ALIGN(sizeof(vta_trace_t) + entries * sizeof(vta_trace_rec_t));
+		dev->trace = vmalloc_user(dev->trace_size);
+		if (!dev->trace)
+			goto error;
+		dev->trace->entries = entries;
+		atomic64_set(&dev->trace_seq, 0);
+	}
+
+	printk(KERN_INFO "DRAM has %lu pages, %d slices\n",
+		1UL << dev->dram_buddy.max_order, dev->total_slice);
+
+	/* IRQ setup. Slices must exist before the handler can fire. */
+	ret = vta_request_irqs(dev);
+	if (ret) {
+		dev_err(&(pdev->dev), "request_irq\n");
+		goto error;
+	}
+	pr_info("irq %d%s\n", dev->pci_irq, dev->irq_per_slice ? ", one MSI-X vector per slice" : "");
+
+	dev->cdevice = device_create_with_groups(cdevice_class, &pdev->dev,
+			MKDEV(major, dev->minor), dev, vta_dev_groups, CDEV_NAME"-%d", dev->minor);
+	if (IS_ERR(dev->cdevice)) {
+		printk(KERN_INFO "Device creation failed\n");
+		ret = PTR_ERR(dev->cdevice);
+		vta_free_irqs(dev);
+		goto error;
+	}
+
+	mutex_lock(&vta_devs_lock);
+	vta_devs[dev->minor] = dev;
+	mutex_unlock(&vta_devs_lock);
+	if (dev->slice_reset)
+		queue_delayed_work(system_wq, &dev->watchdog, msecs_to_jiffies(max(watchdog_ms, 1U)));
+	return 0;
+error:
+	pci_set_drvdata(pdev, NULL);
+	kref_put(&dev->ref, vta_dev_release);
+	return ret;
+}
+
+static void pci_remove(struct pci_dev *pdev)
+{
+	vta_dev_t *dev = pci_get_drvdata(pdev);
+
+	pr_info("pci_remove\n");
+	mutex_lock(&vta_devs_lock);
+	vta_devs[dev->minor] = NULL;
+	mutex_unlock(&vta_devs_lock);
+	device_destroy(cdevice_class, MKDEV(major, dev->minor));
+	cancel_delayed_work_sync(&dev->watchdog);
+	vta_free_irqs(dev);
+	/* Open files keep the rest alive until they are closed. */
+	kref_put(&dev->ref, vta_dev_release);
+}
+
+static struct pci_driver pci_driver = {
+	.name     = "vta_pci",
+	.id_table = pci_ids,
+	.probe    = pci_probe,
+	.remove   = pci_remove,
+};
+
+static void vta_class_destroy(void)
+{
+	int i;
+
+	if (cdevice_any)
+		device_destroy(cdevice_class, MKDEV(major, VTA_ANY_MINOR));
+	for (i = 0; i < ARRAY_SIZE(vta_class_attrs); i++)
+		class_remove_file(cdevice_class, vta_class_attrs[i]);
+	class_destroy(cdevice_class);
+	unregister_chrdev(major, CDEV_NAME);
+}
+
+static void myexit(void)
+{
+	pci_unregister_driver(&pci_driver);
+	vta_class_destroy();
+}
+
+static int myinit(void)
+{
+	int i;
+
+	major = register_chrdev(0, CDEV_NAME, &fops);
+	if (major < 0)
+		return major;
+
+    cdevice_class = class_create(THIS_MODULE, CDEV_NAME);
+    if (IS_ERR(cdevice_class))
+    {
+		printk(KERN_INFO "Class creation failed\n");
+		unregister_chrdev(major, CDEV_NAME);
+		return PTR_ERR(cdevice_class);
+    }
+	for (i = 0; i < ARRAY_SIZE(vta_class_attrs); i++) {
+		if (class_create_file(cdevice_class, vta_class_attrs[i]))
+			printk(KERN_ERR "class_create_file\n");
+	}
+
+	cdevice_any = device_create(cdevice_class, NULL, MKDEV(major, VTA_ANY_MINOR), NULL, CDEV_NAME);
+	if (IS_ERR(cdevice_any))
+		cdevice_any = NULL;
+
+	if (pci_register_driver(&pci_driver) < 0) {
+		vta_class_destroy();
+		return 1;
+	}
+	return 0;
 }
 
 int init_module (void) {
@@ -0,0 +1,468 @@
+/*
+ * ioctl interface of the tvm-vta character device.
+ *
+ * Shared between driver/vta.c and the user-space tools, so keep it free
+ * of kernel-only types.
+ */
+
+#ifndef VTA_IOCTL_H
+#define VTA_IOCTL_H
+
+#include <linux/types.h>
+
+#define IOCTL_TVM_VTA_CMD_EXEC        1
+#define IOCTL_TVM_VTA_CMD_SUBMIT      2
+#define IOCTL_TVM_VTA_CMD_WAIT        3
+#define IOCTL_TVM_VTA_CMD_SET_EVENTFD 4
+#define IOCTL_TVM_VTA_CMD_RING_SETUP  5
+#define IOCTL_TVM_VTA_CMD_RING_KICK   6
+#define IOCTL_TVM_VTA_CMD_REGION_INFO 7
+#define IOCTL_TVM_VTA_CMD_SET_BASE    8
+#define IOCTL_TVM_VTA_CMD_SET_MAP_FLAGS 9
+#define IOCTL_TVM_VTA_CMD_ACQUIRE     10
+#define IOCTL_TVM_VTA_CMD_PIN         11
+#define IOCTL_TVM_VTA_CMD_UNPIN       12
+#define IOCTL_TVM_VTA_CMD_COPY        13
+#define IOCTL_TVM_VTA_CMD_EXEC64      14
+#define IOCTL_TVM_VTA_CMD_SUBMIT64    15
+#define IOCTL_TVM_VTA_CMD_REGISTER_PROGRAM   16
+#define IOCTL_TVM_VTA_CMD_LAUNCH             17
+#define IOCTL_TVM_VTA_CMD_UNREGISTER_PROGRAM 18
+#define IOCTL_TVM_VTA_CMD_SET_CONTEXTS       19
+#define IOCTL_TVM_VTA_CMD_EXEC_BATCH         20
+#define IOCTL_TVM_VTA_CMD_GANG_ACQUIRE       21
+#define IOCTL_TVM_VTA_CMD_GANG_LAUNCH        22
+#define IOCTL_TVM_VTA_CMD_EXEC_TIMES         23
+#define IOCTL_TVM_VTA_CMD_SET_TIMEOUT        24
+#define IOCTL_TVM_VTA_CMD_CANCEL             25
+#define IOCTL_TVM_VTA_CMD_SYNC               26
+#define IOCTL_TVM_VTA_CMD_PIN_SYNC           27
+
+typedef struct {
+	union {
+		struct {
+			__u32 insn_phy_addr;
+			__u32 insn_count;
+			__u32 wait_cycles;
+			__u32 status;
+		};
+		__u32 data[4];
+	};
+} vta_exec_t;
+
+/* IOCTL_TVM_VTA_CMD_SUBMIT: start exec without waiting, seq is written back.
+ * Closing the fd cancels what is still running or queued on its slices
+ * on devices with slice_reset and waits for it otherwise. */
+typedef struct {
+	vta_exec_t exec;
+	__u64 seq;
+} vta_submit_t;
+
+/* IOCTL_TVM_VTA_CMD_EXEC64 and IOCTL_TVM_VTA_CMD_SUBMIT64: the same with a
+ * 64-bit instruction address. version must be VTA_EXEC_VERSION, other
+ * values are refused so the layout can grow. Addresses above 4 GiB need a
+ * device loaded with addr64=1, EOVERFLOW otherwise. */
+#define VTA_EXEC_VERSION 2
+
+typedef struct {
+	__u32 version;
+	__u32 insn_count;
+	__u64 insn_phy_addr;
+	__u32 wait_cycles;
+	__u32 status;
+} vta_exec64_t;
+
+typedef struct {
+	vta_exec64_t exec;
+	__u64 seq;
+} vta_submit64_t;
+
+/* IOCTL_TVM_VTA_CMD_SET_CONTEXTS: number of execs, 1 to
+ * VTA_MAX_CONTEXTS, that SUBMIT, SUBMIT64 and LAUNCH may have outstanding
+ * on the fd. The device starts each one as soon as the previous one
+ * completes; further submissions fail with EBUSY. Default 1. They cannot
+ * be mixed with command ring entries still in flight. */
+#define VTA_MAX_CONTEXTS 8
+
+/* Execs the driver stopped complete with one of these statuses. Stopping
+ * needs a device loaded with slice_reset=1; without it SET_TIMEOUT and
+ * CANCEL fail with EOPNOTSUPP and execs have no deadline.
+ *
+ * IOCTL_TVM_VTA_CMD_SET_TIMEOUT takes the deadline of each later exec of
+ * the fd in ns after it starts, 0 for the exec_timeout_ms module default.
+ * A watchdog stops execs past their deadline with VTA_STATUS_TIMEDOUT and
+ * starts what is queued behind them. IOCTL_TVM_VTA_CMD_CANCEL stops the
+ * running exec of the fd, and of its gang, and completes everything queued
+ * with VTA_STATUS_CANCELED. Blocking execs return ETIMEDOUT and ECANCELED
+ * for them instead of a status. */
+#define VTA_STATUS_TIMEDOUT 0xffffff01
+#define VTA_STATUS_CANCELED 0xffffff02
+
+/* IOCTL_TVM_VTA_CMD_WAIT: wait until submission seq completed.
+ *
+ * seq 0 means the latest submission. timeout_ns < 0 waits forever and 0
+ * only checks. On success status holds the final slice status of that
+ * submission. Statuses are kept for the last VTA_MAX_CONTEXTS completions:
+ * waiting for an older one fails with ENOENT. With VTA_WAIT_COPY, seq refers to
+ * IOCTL_TVM_VTA_CMD_COPY instead and status is 0; copies that could fail
+ * are refused at submission. */
+#define VTA_WAIT_COPY        (1 << 0)
+#define VTA_WAIT_FLAGS_MASK  (VTA_WAIT_COPY)
+
+typedef struct {
+	__u64 seq;
+	__s64 timeout_ns;
+	__u32 status;
+	__u32 flags;
+} vta_wait_t;
+
+/* IOCTL_TVM_VTA_CMD_EXEC_BATCH: run up to VTA_BATCH_MAX execs in one
+ * call and wait for all of them.
+ *
+ * entries points to count vta_batch_entry_t. Each runs on the slice of fd,
+ * or of the ioctl's own fd if fd is -1; other fds must be tvm-vta files of
+ * the caller too. Bit j of deps makes the entry wait until entry j, which
+ * must come earlier, has completed. Entries whose dependencies are met
+ * start right away, so independent ones on different slices run in
+ * parallel. On return result is 0 for entries that ran, with the final
+ * slice status in exec.status, or a negative errno: -ECANCELED if a
+ * dependency did not run or was stopped with VTA_STATUS_TIMEDOUT or
+ * VTA_STATUS_CANCELED, -ENOENT if the status was overwritten by later
+ * completions on the slice, as WAIT does. The ioctl itself only fails if the batch as a
+ * whole could not be processed. */
+#define VTA_BATCH_MAX 64
+
+typedef struct {
+	vta_exec_t exec;
+	__s32 fd;
+	__s32 result;
+	__u64 deps;
+} vta_batch_entry_t;
+
+typedef struct {
+	__u64 entries;
+	__u32 count;
+	__u32 reserved;
+} vta_exec_batch_t;
+
+/* IOCTL_TVM_VTA_CMD_EXEC_TIMES: timing of completed exec seq, 0 for the
+ * latest, from any of EXEC, SUBMIT, LAUNCH, write() or the ring. Records
+ * are kept for the last VTA_MAX_CONTEXTS completions: older ones fail
+ * with ENOENT, ones not complete yet with EAGAIN.
+ *
+ * Timestamps are CLOCK_MONOTONIC ns: when the driver took the exec (for
+ * ring entries the kick that queued them), when it rang the doorbell and
+ * when it saw the exec complete. With VTA_TIMES_CYCLES in flags, cycles is
+ * the device's own count for the exec; it needs a device loaded with
+ * cycle_counter=1. */
+#define VTA_TIMES_CYCLES (1 << 0)
+
+typedef struct {
+	__u64 seq;
+	__u64 cycles;
+	__u64 t_submit;
+	__u64 t_start;
+	__u64 t_complete;
+	__u32 status;
+	__u32 flags;
+} vta_exec_times_t;
+
+/* Batched submission through write() and read().
+ *
+ * write() takes an array of vta_exec_t and submits them in order like
+ * SUBMIT, as many as the submission contexts have room for, returning the
+ * bytes consumed. pwrite() at offset VTA_WRITE_COPY instead takes an
+ * array of vta_copy_t and queues them like COPY; it never blocks.
+ *
+ * read() returns a vta_completion_t for each exec completed since the
+ * last one read or waited for, then one with VTA_COMPLETION_COPY set in
+ * flags for each such copy, replacing WAIT for both. An exec completion
+ * older than the last VTA_MAX_CONTEXTS has VTA_COMPLETION_LOST set and
+ * status 0, as its status is gone. write() of execs and read() block
+ * unless the fd is O_NONBLOCK, and poll() reports when they would not. */
+#define VTA_WRITE_COPY       1
+#define VTA_COMPLETION_COPY  (1 << 0)
+#define VTA_COMPLETION_LOST  (1 << 1)
+
+typedef struct {
+	__u64 seq;
+	__u32 status;
+	__u32 flags;
+} vta_completion_t;
+
+/* Command ring placed in the mapped dram of a slice.
+ *
+ * User space fills entries[tail % entries], bumps tail and rings the
+ * doorbell with IOCTL_TVM_VTA_CMD_RING_KICK. The driver runs entries in
+ * order, back to back, writes the final status into entries[i].status and
+ * bumps head once an entry is done. Indices are free running. */
+#define VTA_RING_MAX_ENTRIES 1024
+
+typedef struct {
+	__u32 head;
+	__u32 tail;
+	__u32 reserved[2];
+	vta_exec_t entries[];
+} vta_ring_t;
+
+/* IOCTL_TVM_VTA_CMD_RING_SETUP: offset is a byte offset into the mapped
+ * dram, entries a power of two up to VTA_RING_MAX_ENTRIES. */
+typedef struct {
+	__u32 offset;
+	__u32 entries;
+} vta_ring_setup_t;
+
+/* IOCTL_TVM_VTA_CMD_RING_KICK takes a __u64 pointer that receives the
+ * sequence number of the last queued entry, usable with WAIT. */
+
+/* Device memory regions.
+ *
+ * Every distinct mmap() offset of an fd is its own region of device dram,
+ * freed by the last munmap of it. Execs run against one base region, the
+ * first one mapped unless IOCTL_TVM_VTA_CMD_SET_BASE picks another by its
+ * mmap offset in bytes; instruction addresses are relative to its start.
+ * IOCTL_TVM_VTA_CMD_REGION_INFO looks a region up by offset and reports
+ * where it sits in device dram, so addresses into other regions can be
+ * derived from dram_addr. */
+typedef struct {
+	__u64 offset;
+	__u64 size;
+	__u64 dram_addr;
+	__u32 is_base;
+	__u32 reserved;
+} vta_region_info_t;
+
+/* IOCTL_TVM_VTA_CMD_SET_MAP_FLAGS: flags for regions created by later
+ * mmap() calls on the fd. Device dram is always mapped with 4 KiB page
+ * entries; VTA_MAP_NO_HUGE is still accepted and has no effect.
+ *
+ * Regions are mapped write-combining, which suits streaming writes but
+ * makes reads and small read-modify-writes slow. A VTA_MAP_CACHED region
+ * is instead mapped as a zeroed, cached host copy of its dram, shared
+ * mappings only. IOCTL_TVM_VTA_CMD_SYNC moves a range of it, rounded out
+ * to cache lines, to dram before the device reads it (FOR_DEVICE) or back
+ * from dram after the device wrote it (FOR_CPU). COPY and execs see only
+ * dram, and a command ring cannot live in such a region.
+ *
+ * FOR_CPU still reads dram through the write-combining mapping, with
+ * streaming loads where the CPU has them, so a single pass over fresh
+ * output is no faster than reading it directly; the host copy pays off
+ * when data is read repeatedly or updated in small pieces. Host copies
+ * count against the device's max_cached_mb, mmap() fails with ENOMEM
+ * past it. */
+#define VTA_MAP_NO_HUGE      (1 << 0)
+#define VTA_MAP_CACHED       (1 << 1)
+#define VTA_MAP_FLAGS_MASK   (VTA_MAP_NO_HUGE | VTA_MAP_CACHED)
+
+#define VTA_SYNC_FOR_DEVICE  0
+#define VTA_SYNC_FOR_CPU     1
+
+/* region is the mmap offset of the region, offset and size in bytes. */
+typedef struct {
+	__u64 region;
+	__u64 offset;
+	__u64 size;
+	__u32 dir;
+	__u32 reserved;
+} vta_sync_t;
+
+/* IOCTL_TVM_VTA_CMD_ACQUIRE: bind a slice to the fd, waiting in the
+ * device's admission queue while all slices are taken.
+ *
+ * Waiters are served by priority, higher first, then in arrival order.
+ * timeout_ns < 0 waits forever and 0 fails with EBUSY instead of queueing.
+ * On success slice holds the slice index. mmap() never waits: without a
+ * slice bound it fails with EBUSY when none is free. */
+typedef struct {
+	__s64 timeout_ns;
+	__u32 priority;
+	__s32 slice;
+} vta_acquire_t;
+
+/* Registered programs.
+ *
+ * IOCTL_TVM_VTA_CMD_REGISTER_PROGRAM checks once that insn_count
+ * instructions at insn_phy_addr lie inside the base region and returns a
+ * handle. The region stays allocated until the program is unregistered by
+ * handle or the fd is closed.
+ *
+ * IOCTL_TVM_VTA_CMD_LAUNCH runs a program. base_offset moves the dram base
+ * of this exec that many bytes into the program's region, e.g. to the
+ * buffers of one request; the instruction address is rebased to still
+ * point at the program, wrapping like the device's address adder. With
+ * VTA_LAUNCH_WAIT it blocks and returns the final status like EXEC,
+ * otherwise it writes back seq for WAIT. */
+#define VTA_INSN_BYTES   16
+#define VTA_LAUNCH_WAIT  (1 << 0)
+
+typedef struct {
+	__u64 insn_phy_addr;
+	__u32 insn_count;
+	__u32 wait_cycles;
+	__u32 handle;
+	__u32 reserved;
+} vta_program_t;
+
+typedef struct {
+	__u32 handle;
+	__u32 flags;
+	__u64 base_offset;
+	__u64 seq;
+} vta_launch_t;
+
+/* Gangs: one fd driving several slices for data-parallel execs.
+ *
+ * IOCTL_TVM_VTA_CMD_GANG_ACQUIRE grows the gang of the fd, its own slice
+ * first, towards count slices. It never waits: it takes the slices free
+ * right now and reports the resulting gang size in size. Slices stay in
+ * the gang until the fd is closed.
+ *
+ * IOCTL_TVM_VTA_CMD_GANG_LAUNCH runs a registered program on the first
+ * count gang members at once. offsets points to count __u64 base offsets
+ * into the program's region, one per member, used like the base_offset
+ * of LAUNCH. The call returns once every member completed; if statuses is
+ * set, the final status of each member is written there as a __u32. It
+ * fails with the error of the first member that could not run. */
+#define VTA_GANG_MAX 32
+
+typedef struct {
+	__u32 count;
+	__u32 size;
+} vta_gang_t;
+
+typedef struct {
+	__u32 handle;
+	__u32 count;
+	__u64 offsets;
+	__u64 statuses;
+} vta_gang_launch_t;
+
+/* Host memory the device reads (and with VTA_PIN_DEVICE_WRITE writes) in
+ * place, without staging it through mapped dram.
+ *
+ * IOCTL_TVM_VTA_CMD_PIN pins [addr, addr + size) and maps it for DMA. The
+ * mapping may come back in several bus-contiguous segments: nr_segs is
+ * their count, dma_addr the start of the first one, and if segs is set up
+ * to max_segs of them are written there. handle names the buffer for
+ * IOCTL_TVM_VTA_CMD_UNPIN, which takes the handle as its argument. Buffers
+ * still pinned are released when the fd is closed. Pinned pages count as
+ * locked memory of the process that pinned them, against RLIMIT_MEMLOCK
+ * unless it has CAP_IPC_LOCK, and against the driver's max_pinned_mb per
+ * fd.
+ *
+ * The DMA mapping may go through bounce buffers, so the buffer belongs to
+ * the device only between IOCTL_TVM_VTA_CMD_PIN_SYNC with
+ * VTA_SYNC_FOR_DEVICE, after the CPU last wrote it, and PIN_SYNC with
+ * VTA_SYNC_FOR_CPU, before the CPU reads what the device wrote. The
+ * argument is a vta_pin_sync_t. */
+#define VTA_PIN_DEVICE_WRITE (1 << 0)
+#define VTA_PIN_FLAGS_MASK   (VTA_PIN_DEVICE_WRITE)
+
+typedef struct {
+	__u64 dma_addr;
+	__u64 len;
+} vta_pin_seg_t;
+
+typedef struct {
+	__u64 addr;
+	__u64 size;
+	__u64 segs;
+	__u32 max_segs;
+	__u32 flags;
+	__u32 handle;
+	__u32 nr_segs;
+	__u64 dma_addr;
+} vta_pin_t;
+
+/* dir is VTA_SYNC_FOR_DEVICE or VTA_SYNC_FOR_CPU. */
+typedef struct {
+	__u32 handle;
+	__u32 dir;
+} vta_pin_sync_t;
+
+/* IOCTL_TVM_VTA_CMD_COPY: copy size bytes between user memory at addr and
+ * offset bytes into the region mapped at mmap offset region, without
+ * waiting. Copies of an fd run one after another in submission order and
+ * are numbered apart from execs; seq is written back for WAIT with
+ * VTA_WAIT_COPY, and the eventfd is signalled as each one completes. */
+#define VTA_COPY_TO_DEVICE   0
+#define VTA_COPY_FROM_DEVICE 1
+
+typedef struct {
+	__u64 addr;
+	__u64 region;
+	__u64 offset;
+	__u64 size;
+	__u32 dir;
+	__u32 reserved;
+	__u64 seq;
+} vta_copy_t;
+
+/* Exec trace ring of a device, enabled by the trace_entries module
+ * parameter.
+ *
+ * Map it read-only at mmap offset VTA_MMAP_TRACE_OFFSET, the header is
+ * followed by entries records. Record i sits at records[i % entries] and
+ * carries seq = i + 1 once complete; head is the number of records started.
+ * Readers copy a record and re-check its seq to detect overwrites, no lock
+ * is taken. Timestamps are CLOCK_MONOTONIC ns at ioctl entry, after the
+ * argument copy, at the doorbell write, at the status change and at return.
+ * mmap() offsets from VTA_MMAP_RESERVED_OFFSET up are not device dram. */
+#define VTA_MMAP_RESERVED_OFFSET (1ULL << 40)
+#define VTA_MMAP_TRACE_OFFSET    VTA_MMAP_RESERVED_OFFSET
+
+typedef struct {
+	__u64 seq;
+	__u64 t_enter;
+	__u64 t_copied;
+	__u64 t_start;
+	__u64 t_done;
+	__u64 t_return;
+	__u32 pid;
+	__u32 slice;
+	__u32 insn_count;
+	__u32 status;
+} vta_trace_rec_t;
+
+typedef struct {
+	__u64 head;
+	__u32 entries;
+	__u32 reserved[13];
+	vta_trace_rec_t records[];
+} vta_trace_t;
+
+/* Control page of a slice, on devices loaded with ctrl_paged=1.
+ *
+ * mmap() of one shared page at VTA_MMAP_CONTROL_OFFSET maps the control
+ * block of the fd's slice, binding a free slice first like a dram mapping
+ * does; the fd needs a base region, see SET_BASE. It holds __u32 words at
+ * the VTA_CTRL_* indices, the _HI ones only on addr64 devices and
+ * VTA_CTRL_CYCLES only with cycle_counter. Fill in the exec, then write
+ * VTA_STATUS_RUNNING to the status word to ring the doorbell; the device
+ * changes it once the exec is done.
+ *
+ * The dram base words are not on this page. The kernel sets them to the
+ * fd's base region when the page is mapped, so execs rung from it stay in
+ * the fd's dram like those it starts itself. SET_BASE fails with EBUSY
+ * while the page is mapped, and regions unmapped meanwhile keep their
+ * dram until it is unmapped.
+ *
+ * The mapping is not inherited by fork(). While it exists the slice
+ * belongs to user space: EXEC, SUBMIT, LAUNCH, write() and RING_KICK fail
+ * with EBUSY, and mapping fails with EBUSY while any of them is running.
+ * The last munmap() waits for a running exec, or stops it on devices with
+ * slice_reset, before the kernel uses the slice again. */
+#define VTA_MMAP_CONTROL_OFFSET (VTA_MMAP_RESERVED_OFFSET + (1ULL << 32))
+
+#define VTA_CTRL_INSN_ADDR    0
+#define VTA_CTRL_INSN_COUNT   1
+#define VTA_CTRL_WAIT_CYCLES  2
+#define VTA_CTRL_DRAM_BASE    3
+#define VTA_CTRL_STATUS       4
+#define VTA_CTRL_INSN_ADDR_HI 5
+#define VTA_CTRL_DRAM_BASE_HI 6
+#define VTA_CTRL_CYCLES       7
+
+#define VTA_STATUS_RUNNING 1
+
+#endif /* VTA_IOCTL_H */
@@ -0,0 +1,186 @@
+/*
+ * Output readback and small read-modify-write updates on a write-combining
+ * dram mapping against a VTA_MAP_CACHED one with explicit syncs. Every
+ * cached readback pass includes its FOR_CPU sync, which itself reads dram
+ * through the write-combining mapping.
+ *
+ *     $ gcc -O2 -o vta_cache_bench vta_cache_bench.c
+ *     $ ./vta_cache_bench -s 4 -p 8 -u 256
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../driver/vta_ioctl.h"
+
+#define DEV_NAME "/dev/tvm-vta-0"
+#define WC_OFFSET 0
+#define CACHED_OFFSET (1UL << 30)
+
+static void print_usage(const char *prog)
+{
+    fprintf(stdout,"Usage: %s [-hdspun]\n",prog);
+    fprintf(stdout,"\t-d --device\t\t\t\t: device to use.\n");
+    fprintf(stdout,"\t-s --size\t\t\t\t: output buffer size in MiB.\n");
+    fprintf(stdout,"\t-p --passes\t\t\t\t: readback passes per mode.\n");
+    fprintf(stdout,"\t-u --update\t\t\t\t: bytes per small update.\n");
+    fprintf(stdout,"\t-n --updates\t\t\t\t: small updates per mode.\n");
+    fprintf(stdout,"\t-h --help\t\t\t\t: print this message\n");
+    return;
+}
+
+static const struct option lopts[] = {
+    { "device", required_argument, 0, 'd' },
+    { "size", required_argument, 0, 's' },
+    { "passes", required_argument, 0, 'p' },
+    { "update", required_argument, 0, 'u' },
+    { "updates", required_argument, 0, 'n' },
+    { "help", no_argument, 0, 'h' },
+    { 0, 0, 0, 0 },
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int sync_range(int fd, size_t offset, size_t size, unsigned dir)
+{
+    vta_sync_t sync;
+
+    memset(&sync, 0, sizeof(sync));
+    sync.region = CACHED_OFFSET;
+    sync.offset = offset;
+    sync.size = size;
+    sync.dir = dir;
+    if (ioctl(fd, IOCTL_TVM_VTA_CMD_SYNC, &sync) < 0) {
+        fprintf(stderr,"sync: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t sum(const volatile uint64_t *buf, size_t size)
+{
+    uint64_t s = 0;
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+        s += buf[i];
+    return s;
+}
+
+/* Read the whole output as a consumer would after an exec. */
+static double bench_readback(int fd, volatile uint64_t *buf, size_t size, int passes,
+                             int cached, uint64_t *check)
+{
+    double start = now_s();
+    for (int p = 0; p < passes; p++) {
+        if (cached && sync_range(fd, 0, size, VTA_SYNC_FOR_CPU) < 0)
+            return -1;
+        *check += sum(buf, size);
+    }
+    return now_s() - start;
+}
+
+/* Bump every word of a small tensor and hand it back to the device. */
+static double bench_update(int fd, volatile uint64_t *buf, size_t size, size_t update,
+                           int updates, int cached)
+{
+    double start = now_s();
+    for (int n = 0; n < updates; n++) {
+        size_t offset = ((size_t)n * update) % (size - update + 1) & ~(size_t)63;
+        volatile uint64_t *t = buf + offset / sizeof(uint64_t);
+        for (size_t i = 0; i < update / sizeof(uint64_t); i++)
+            t[i] = t[i] + 1;
+        if (cached && sync_range(fd, offset, update, VTA_SYNC_FOR_DEVICE) < 0)
+            return -1;
+    }
+    return now_s() - start;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* device = DEV_NAME;
+    size_t size = 4 << 20;
+    size_t update = 256;
+    int passes = 8;
+    int updates = 100000;
+    int option_index = 0;
+    int c, fd;
+    uint64_t check = 0;
+    double t_wc_read, t_c_read, t_wc_upd, t_c_upd;
+
+    while ((c = getopt_long(argc, argv, "hd:s:p:u:n:", lopts, &option_index)) != -1) {
+        switch (c) {
+            case 'd': device = optarg; break;
+            case 's': size = strtoul(optarg, NULL, 0) << 20; break;
+            case 'p': passes = atoi(optarg); break;
+            case 'u': update = strtoul(optarg, NULL, 0); break;
+            case 'n': updates = atoi(optarg); break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    if (!size || passes <= 0 || updates <= 0 || update < sizeof(uint64_t) || update > size) {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    fd = open(device, O_RDWR);
+    if (fd < 0){
+        fprintf(stderr,"open: %s\n", strerror(errno));
+        return -1;
+    }
+
+    uint64_t *wc = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, WC_OFFSET);
+    if (wc == MAP_FAILED) {
+        fprintf(stderr, "error in mmap\n");
+        close(fd);
+        return -1;
+    }
+    if (ioctl(fd, IOCTL_TVM_VTA_CMD_SET_MAP_FLAGS, VTA_MAP_CACHED) < 0) {
+        fprintf(stderr,"map flags: %s\n", strerror(errno));
+        return -1;
+    }
+    uint64_t *cached = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, CACHED_OFFSET);
+    if (cached == MAP_FAILED) {
+        fprintf(stderr, "error in cached mmap\n");
+        return -1;
+    }
+    memset(wc, 0, size);
+    memset(cached, 0, size);
+    if (sync_range(fd, 0, size, VTA_SYNC_FOR_DEVICE) < 0)
+        return -1;
+
+    t_wc_read = bench_readback(fd, wc, size, passes, 0, &check);
+    t_c_read = bench_readback(fd, cached, size, passes, 1, &check);
+    t_wc_upd = bench_update(fd, wc, size, update, updates, 0);
+    t_c_upd = bench_update(fd, cached, size, update, updates, 1);
+    if (t_wc_read < 0 || t_c_read < 0 || t_wc_upd < 0 || t_c_upd < 0)
+        return -1;
+
+    fprintf(stdout,"readback %zu KiB x %d\n", size >> 10, passes);
+    fprintf(stdout,"  wc          : %8.1f MiB/s\n", passes * (size / 1048576.0) / t_wc_read);
+    fprintf(stdout,"  cached+sync : %8.1f MiB/s\n", passes * (size / 1048576.0) / t_c_read);
+    fprintf(stdout,"update %zu B x %d\n", update, updates);
+    fprintf(stdout,"  wc          : %8.3f us/update\n", t_wc_upd * 1e6 / updates);
+    fprintf(stdout,"  cached+sync : %8.3f us/update\n", t_c_upd * 1e6 / updates);
+    fprintf(stdout,"(checksum %llx)\n", (unsigned long long)check);
+
+    munmap(cached, size);
+    munmap(wc, size);
+    close(fd);
+    return 0;
+}
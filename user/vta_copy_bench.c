@@ -0,0 +1,201 @@
+/*
+ * Bandwidth of IOCTL_TVM_VTA_CMD_COPY against CPU loads and stores on the
+ * mapped device dram. The mapping is write-combining, so plain loads are
+ * uncached; the copy ioctl and the "cpu stream" column read it with SSE4.1
+ * streaming loads instead, which should come out well ahead of "cpu load".
+ *
+ *     $ gcc -O2 -o vta_copy_bench vta_copy_bench.c
+ *     $ ./vta_copy_bench -s 64 -p 4
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../driver/vta_ioctl.h"
+
+#define DEV_NAME "/dev/tvm-vta-0"
+
+static void print_usage(const char *prog)
+{
+    fprintf(stdout,"Usage: %s [-hdspc]\n",prog);
+    fprintf(stdout,"\t-d --device\t\t\t\t: device to use.\n");
+    fprintf(stdout,"\t-s --size\t\t\t\t: buffer size in MiB.\n");
+    fprintf(stdout,"\t-p --passes\t\t\t\t: passes per test.\n");
+    fprintf(stdout,"\t-c --chunk\t\t\t\t: bytes per copy ioctl in KiB, 0 for one per pass.\n");
+    fprintf(stdout,"\t-h --help\t\t\t\t: print this message\n");
+    return;
+}
+
+static const struct option lopts[] = {
+    { "device", required_argument, 0, 'd' },
+    { "size", required_argument, 0, 's' },
+    { "passes", required_argument, 0, 'p' },
+    { "chunk", required_argument, 0, 'c' },
+    { "help", no_argument, 0, 'h' },
+    { 0, 0, 0, 0 },
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int wait_copies(int fd)
+{
+    vta_wait_t wait;
+
+    memset(&wait, 0, sizeof(wait));
+    wait.timeout_ns = -1;
+    wait.flags = VTA_WAIT_COPY;
+    if (ioctl(fd, IOCTL_TVM_VTA_CMD_WAIT, &wait) < 0) {
+        fprintf(stderr,"wait: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Queue the whole buffer in chunks, then wait for the last one. */
+static double bench_copy(int fd, char *host, size_t size, size_t chunk, int dir, int passes)
+{
+    vta_copy_t cp;
+    double t = now_s();
+
+    for (int p = 0; p < passes; p++) {
+        for (size_t off = 0; off < size; off += chunk) {
+            memset(&cp, 0, sizeof(cp));
+            cp.addr = (uintptr_t)(host + off);
+            cp.region = 0;
+            cp.offset = off;
+            cp.size = size - off < chunk ? size - off : chunk;
+            cp.dir = dir;
+            if (ioctl(fd, IOCTL_TVM_VTA_CMD_COPY, &cp) < 0) {
+                fprintf(stderr,"copy: %s\n", strerror(errno));
+                return -1;
+            }
+        }
+    }
+    if (wait_copies(fd) < 0)
+        return -1;
+    return now_s() - t;
+}
+
+/* memcpy() from dram with MOVNTDQA, 64 bytes at a time, where available. */
+static void stream_read(char *host, const char *dram, size_t size)
+{
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("sse4.1"))
+        for (; size >= 64; size -= 64, dram += 64, host += 64)
+            __asm__ volatile("movntdqa (%0), %%xmm0\n\t"
+                             "movntdqa 16(%0), %%xmm1\n\t"
+                             "movntdqa 32(%0), %%xmm2\n\t"
+                             "movntdqa 48(%0), %%xmm3\n\t"
+                             "movdqu %%xmm0, (%1)\n\t"
+                             "movdqu %%xmm1, 16(%1)\n\t"
+                             "movdqu %%xmm2, 32(%1)\n\t"
+                             "movdqu %%xmm3, 48(%1)\n\t"
+                             : : "r" (dram), "r" (host) : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+#endif
+    memcpy(host, dram, size);
+}
+
+static double bench_stream(char *dram, char *host, size_t size, int passes)
+{
+    double t = now_s();
+
+    for (int p = 0; p < passes; p++)
+        stream_read(host, dram, size);
+    return now_s() - t;
+}
+
+static double bench_cpu(char *dram, char *host, size_t size, int dir, int passes)
+{
+    double t = now_s();
+
+    for (int p = 0; p < passes; p++) {
+        if (dir == VTA_COPY_TO_DEVICE)
+            memcpy(dram, host, size);
+        else
+            memcpy(host, dram, size);
+    }
+    __sync_synchronize();
+    return now_s() - t;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* device = DEV_NAME;
+    size_t size = 64ul << 20;
+    size_t chunk = 1ul << 20;
+    int passes = 4;
+    int option_index = 0;
+    int c, fd;
+    double t[5];
+
+    while ((c = getopt_long(argc, argv, "hd:s:p:c:", lopts, &option_index)) != -1) {
+        switch (c) {
+            case 'd': device = optarg; break;
+            case 's': size = strtoul(optarg, NULL, 0) << 20; break;
+            case 'p': passes = atoi(optarg); break;
+            case 'c': chunk = strtoul(optarg, NULL, 0) << 10; break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    if (size == 0 || passes <= 0) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    if (chunk == 0 || chunk > size)
+        chunk = size;
+
+    fd = open(device, O_RDWR);
+    if (fd < 0){
+        fprintf(stderr,"open: %s\n", strerror(errno));
+        return -1;
+    }
+    char *dram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (dram == MAP_FAILED) {
+        fprintf(stderr, "error in mmap\n");
+        close(fd);
+        return -1;
+    }
+    char *host = aligned_alloc(4096, size);
+    if (!host) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    memset(host, 0x5a, size);
+
+    t[0] = bench_cpu(dram, host, size, VTA_COPY_TO_DEVICE, passes);
+    t[1] = bench_copy(fd, host, size, chunk, VTA_COPY_TO_DEVICE, passes);
+    t[2] = bench_cpu(dram, host, size, VTA_COPY_FROM_DEVICE, passes);
+    t[3] = bench_copy(fd, host, size, chunk, VTA_COPY_FROM_DEVICE, passes);
+    t[4] = bench_stream(dram, host, size, passes);
+    if (t[1] < 0 || t[3] < 0)
+        return -1;
+
+    double bytes = (double)size * passes;
+    fprintf(stdout,"%zu MiB x %d, copy chunk %zu KiB\n", size >> 20, passes, chunk >> 10);
+    fprintf(stdout,"to device   cpu store %8.3f GB/s  copy ioctl %8.3f GB/s\n",
+            bytes / t[0] / 1e9, bytes / t[1] / 1e9);
+    fprintf(stdout,"from device cpu load  %8.3f GB/s  copy ioctl %8.3f GB/s  cpu stream %8.3f GB/s\n",
+            bytes / t[2] / 1e9, bytes / t[3] / 1e9, bytes / t[4] / 1e9);
+
+    free(host);
+    munmap(dram, size);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Compare per-ioctl exec against ringing the doorbell of a mapped slice
+ * control page. Needs the driver loaded with ctrl_paged=1.
+ *
+ *     $ gcc -O2 -o vta_doorbell_bench vta_doorbell_bench.c
+ *     $ ./vta_doorbell_bench -n 10000 -c 16
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../driver/vta_ioctl.h"
+
+#define DEV_NAME "/dev/tvm-vta-0"
+#define MAP_SIZE (4096 * 1024)
+#define CTRL_SIZE 4096
+
+static void print_usage(const char *prog)
+{
+    fprintf(stdout,"Usage: %s [-hdnac]\n",prog);
+    fprintf(stdout,"\t-d --device\t\t\t\t: device to use.\n");
+    fprintf(stdout,"\t-n --iterations\t\t\t\t: number of execs per mode.\n");
+    fprintf(stdout,"\t-a --addr\t\t\t\t: instruction address in the slice.\n");
+    fprintf(stdout,"\t-c --count\t\t\t\t: instructions per exec.\n");
+    fprintf(stdout,"\t-h --help\t\t\t\t: print this message\n");
+    return;
+}
+
+static const struct option lopts[] = {
+    { "device", required_argument, 0, 'd' },
+    { "iterations", required_argument, 0, 'n' },
+    { "addr", required_argument, 0, 'a' },
+    { "count", required_argument, 0, 'c' },
+    { "help", no_argument, 0, 'h' },
+    { 0, 0, 0, 0 },
+};
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double bench_ioctl(int fd, vta_exec_t *exec, int iterations)
+{
+    double start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        if (ioctl(fd, IOCTL_TVM_VTA_CMD_EXEC, exec) < 0) {
+            fprintf(stderr,"exec: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return now_us() - start;
+}
+
+/* The whole exec without a syscall: program the block, ring, poll. The
+ * kernel set the dram base to the region mapped first. */
+static double bench_doorbell(volatile __u32 *ctrl, vta_exec_t *exec, int iterations)
+{
+    double start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        ctrl[VTA_CTRL_INSN_ADDR] = exec->insn_phy_addr;
+        ctrl[VTA_CTRL_INSN_COUNT] = exec->insn_count;
+        ctrl[VTA_CTRL_WAIT_CYCLES] = exec->wait_cycles;
+        __sync_synchronize();
+        ctrl[VTA_CTRL_STATUS] = VTA_STATUS_RUNNING;
+        while (ctrl[VTA_CTRL_STATUS] == VTA_STATUS_RUNNING)
+            ;
+    }
+    return now_us() - start;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* device = DEV_NAME;
+    int iterations = 10000;
+    vta_exec_t exec;
+    int option_index = 0;
+    int c, fd;
+    double t_ioctl, t_doorbell;
+
+    memset(&exec, 0, sizeof(exec));
+    exec.insn_count = 16;
+
+    while ((c = getopt_long(argc, argv, "hd:n:a:c:", lopts, &option_index)) != -1) {
+        switch (c) {
+            case 'd': device = optarg; break;
+            case 'n': iterations = atoi(optarg); break;
+            case 'a': exec.insn_phy_addr = strtoul(optarg, NULL, 0); break;
+            case 'c': exec.insn_count = strtoul(optarg, NULL, 0); break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    if (iterations <= 0)
+        iterations = 1;
+
+    fd = open(device, O_RDWR);
+    if (fd < 0){
+        fprintf(stderr,"open: %s\n", strerror(errno));
+        return -1;
+    }
+
+    char* address = mmap (NULL, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        fprintf(stderr, "error in mmap\n");
+        close(fd);
+        return -1;
+    }
+
+    /* The kernel refuses execs while the control page is mapped, so run
+     * the ioctl side first. */
+    t_ioctl = bench_ioctl(fd, &exec, iterations);
+    if (t_ioctl < 0)
+        return -1;
+
+    void* ctrl = mmap (NULL, CTRL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                       VTA_MMAP_CONTROL_OFFSET);
+    if (ctrl == MAP_FAILED) {
+        fprintf(stderr,"control page: %s\n", strerror(errno));
+        return -1;
+    }
+    t_doorbell = bench_doorbell((volatile __u32 *)ctrl, &exec, iterations);
+    munmap(ctrl, CTRL_SIZE);
+
+    fprintf(stdout,"insn_count %u, %d execs\n", exec.insn_count, iterations);
+    fprintf(stdout,"ioctl   : %10.2f us total %8.3f us/exec\n", t_ioctl, t_ioctl / iterations);
+    fprintf(stdout,"doorbell: %10.2f us total %8.3f us/exec\n", t_doorbell, t_doorbell / iterations);
+
+    munmap(address, MAP_SIZE);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * First-touch time and write bandwidth into mapped device dram. Faults
+ * are served with 4 KiB entries, fault_around_pages at a time.
+ *
+ *     $ gcc -O2 -o vta_map_bench vta_map_bench.c
+ *     $ ./vta_map_bench -s 64 -p 4
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../driver/vta_ioctl.h"
+
+#define DEV_NAME "/dev/tvm-vta-0"
+
+static void print_usage(const char *prog)
+{
+    fprintf(stdout,"Usage: %s [-hdsp]\n",prog);
+    fprintf(stdout,"\t-d --device\t\t\t\t: device to use.\n");
+    fprintf(stdout,"\t-s --size\t\t\t\t: mapping size in MiB.\n");
+    fprintf(stdout,"\t-p --passes\t\t\t\t: passes over the mapping per test.\n");
+    fprintf(stdout,"\t-h --help\t\t\t\t: print this message\n");
+    return;
+}
+
+static const struct option lopts[] = {
+    { "device", required_argument, 0, 'd' },
+    { "size", required_argument, 0, 's' },
+    { "passes", required_argument, 0, 'p' },
+    { "help", no_argument, 0, 'h' },
+    { 0, 0, 0, 0 },
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_seq(uint64_t *buf, size_t size)
+{
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+        buf[i] = i;
+}
+
+/* 64-byte stores at random cache lines, stresses the TLB rather than
+ * the write-combining buffers. */
+static void write_rand(uint64_t *buf, size_t size, uint64_t *seed)
+{
+    size_t lines = size / 64;
+    uint64_t x = *seed;
+    for (size_t i = 0; i < lines; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        uint64_t *line = buf + (x % lines) * 8;
+        for (int j = 0; j < 8; j++)
+            line[j] = x;
+    }
+    *seed = x;
+}
+
+static int run(const char *device, int flags, size_t size, int passes)
+{
+    uint64_t seed = 88172645463325252ull;
+    double t, first, seq, rnd;
+    int fd;
+
+    fd = open(device, O_RDWR);
+    if (fd < 0){
+        fprintf(stderr,"open: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ioctl(fd, IOCTL_TVM_VTA_CMD_SET_MAP_FLAGS, flags) < 0) {
+        fprintf(stderr,"set map flags: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    uint64_t *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "error in mmap\n");
+        close(fd);
+        return -1;
+    }
+
+    /* The first pass includes populating the page tables. */
+    t = now_s();
+    write_seq(buf, size);
+    first = now_s() - t;
+
+    t = now_s();
+    for (int i = 0; i < passes; i++)
+        write_seq(buf, size);
+    seq = now_s() - t;
+
+    t = now_s();
+    for (int i = 0; i < passes; i++)
+        write_rand(buf, size, &seed);
+    rnd = now_s() - t;
+
+    fprintf(stdout,"%-6s addr %p first touch %8.3f ms seq %8.3f GB/s rand %8.3f GB/s\n",
+            "4k", (void *)buf, first * 1e3,
+            size * (double)passes / seq / 1e9, size * (double)passes / rnd / 1e9);
+
+    munmap(buf, size);
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* device = DEV_NAME;
+    size_t size = 64ul << 20;
+    int passes = 4;
+    int option_index = 0;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "hd:s:p:", lopts, &option_index)) != -1) {
+        switch (c) {
+            case 'd': device = optarg; break;
+            case 's': size = strtoul(optarg, NULL, 0) << 20; break;
+            case 'p': passes = atoi(optarg); break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    if (size == 0 || passes <= 0) {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    if (run(device, 0, size, passes) < 0)
+        return -1;
+    return 0;
+}
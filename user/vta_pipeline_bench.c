@@ -0,0 +1,246 @@
+/*
+ * End-to-end "write inputs, exec, read outputs" loop, serial against
+ * double-buffered with two submission contexts. Device busy time comes
+ * from the stats attribute of the device, the rest of the wall time is the
+ * device sitting idle between execs.
+ *
+ *     $ gcc -O2 -o vta_pipeline_bench vta_pipeline_bench.c
+ *     $ ./vta_pipeline_bench -n 1000 -i 256 -o 64 -c 128
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <libgen.h>
+#include <time.h>
+
+#include "../driver/vta_ioctl.h"
+
+#define DEV_NAME "/dev/tvm-vta-0"
+#define MAP_SIZE (16 << 20)
+#define PROGRAM_SIZE (1 << 20)
+
+static void print_usage(const char *prog)
+{
+    fprintf(stdout,"Usage: %s [-hdnioc]\n",prog);
+    fprintf(stdout,"\t-d --device\t\t\t\t: device to use.\n");
+    fprintf(stdout,"\t-n --iterations\t\t\t\t: requests per mode.\n");
+    fprintf(stdout,"\t-i --input\t\t\t\t: input bytes per request in KiB.\n");
+    fprintf(stdout,"\t-o --output\t\t\t\t: output bytes per request in KiB.\n");
+    fprintf(stdout,"\t-c --count\t\t\t\t: instructions per exec.\n");
+    fprintf(stdout,"\t-h --help\t\t\t\t: print this message\n");
+    return;
+}
+
+static const struct option lopts[] = {
+    { "device", required_argument, 0, 'd' },
+    { "iterations", required_argument, 0, 'n' },
+    { "input", required_argument, 0, 'i' },
+    { "output", required_argument, 0, 'o' },
+    { "count", required_argument, 0, 'c' },
+    { "help", no_argument, 0, 'h' },
+    { 0, 0, 0, 0 },
+};
+
+static char stats_path[256];
+static size_t in_size, out_size;
+static char *host_in, *host_out;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define NO_STATS (~0ull)
+
+/* Total busy_ns of the device, or NO_STATS if it cannot be read. */
+static unsigned long long busy_ns(void)
+{
+    unsigned long long execs, busy = NO_STATS;
+    char line[256];
+    FILE *f = fopen(stats_path, "r");
+
+    if (!f)
+        return NO_STATS;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "total execs %llu busy_ns %llu", &execs, &busy) == 2)
+            break;
+    }
+    fclose(f);
+    return busy;
+}
+
+/* Buffer set b: inputs then outputs, after the program. */
+static char *buffers(char *dram, int b)
+{
+    return dram + PROGRAM_SIZE + b * (in_size + out_size);
+}
+
+static int launch(int fd, __u32 handle, int b, int wait, __u64 *seq)
+{
+    vta_launch_t l;
+    long ret;
+
+    memset(&l, 0, sizeof(l));
+    l.handle = handle;
+    l.flags = wait ? VTA_LAUNCH_WAIT : 0;
+    l.base_offset = PROGRAM_SIZE + b * (in_size + out_size);
+    ret = ioctl(fd, IOCTL_TVM_VTA_CMD_LAUNCH, &l);
+    if (ret < 0) {
+        fprintf(stderr,"launch: %s\n", strerror(errno));
+        return -1;
+    }
+    if (seq)
+        *seq = l.seq;
+    return 0;
+}
+
+static int wait_seq(int fd, __u64 seq)
+{
+    vta_wait_t wait;
+
+    memset(&wait, 0, sizeof(wait));
+    wait.seq = seq;
+    wait.timeout_ns = -1;
+    if (ioctl(fd, IOCTL_TVM_VTA_CMD_WAIT, &wait) < 0) {
+        fprintf(stderr,"wait: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int run_serial(int fd, char *dram, __u32 handle, int iterations)
+{
+    for (int i = 0; i < iterations; i++) {
+        memcpy(buffers(dram, 0), host_in, in_size);
+        if (launch(fd, handle, 0, 1, NULL) < 0)
+            return -1;
+        memcpy(host_out, buffers(dram, 0) + in_size, out_size);
+    }
+    return 0;
+}
+
+/* Fill and submit request i while request i - 1 runs, then collect it. */
+static int run_pipelined(int fd, char *dram, __u32 handle, int iterations)
+{
+    __u64 seq[2];
+
+    if (ioctl(fd, IOCTL_TVM_VTA_CMD_SET_CONTEXTS, 2) < 0) {
+        fprintf(stderr,"set contexts: %s\n", strerror(errno));
+        return -1;
+    }
+    memcpy(buffers(dram, 0), host_in, in_size);
+    if (launch(fd, handle, 0, 0, &seq[0]) < 0)
+        return -1;
+    for (int i = 1; i <= iterations; i++) {
+        int cur = i & 1, prev = cur ^ 1;
+        if (i < iterations) {
+            memcpy(buffers(dram, cur), host_in, in_size);
+            if (launch(fd, handle, cur, 0, &seq[cur]) < 0)
+                return -1;
+        }
+        if (wait_seq(fd, seq[prev]) < 0)
+            return -1;
+        memcpy(host_out, buffers(dram, prev) + in_size, out_size);
+    }
+    return 0;
+}
+
+static void report(const char *name, double wall, unsigned long long busy, int iterations)
+{
+    fprintf(stdout,"%-10s %10.2f us/request", name, wall * 1e6 / iterations);
+    if (busy != NO_STATS)
+        fprintf(stdout,"  device busy %5.1f%%  idle gap %8.2f us/request",
+                busy / 1e9 / wall * 100, (wall - busy / 1e9) * 1e6 / iterations);
+    fprintf(stdout,"\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* device = DEV_NAME;
+    int iterations = 1000;
+    vta_program_t prog;
+    int option_index = 0;
+    int c, fd;
+    double t;
+    unsigned long long busy;
+
+    memset(&prog, 0, sizeof(prog));
+    prog.insn_count = 128;
+    in_size = 256 << 10;
+    out_size = 64 << 10;
+
+    while ((c = getopt_long(argc, argv, "hd:n:i:o:c:", lopts, &option_index)) != -1) {
+        switch (c) {
+            case 'd': device = optarg; break;
+            case 'n': iterations = atoi(optarg); break;
+            case 'i': in_size = strtoul(optarg, NULL, 0) << 10; break;
+            case 'o': out_size = strtoul(optarg, NULL, 0) << 10; break;
+            case 'c': prog.insn_count = strtoul(optarg, NULL, 0); break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    if (iterations <= 0 || PROGRAM_SIZE + 2 * (in_size + out_size) > MAP_SIZE ||
+            (size_t)prog.insn_count * VTA_INSN_BYTES > PROGRAM_SIZE) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    char *name = strdup(device);
+    snprintf(stats_path, sizeof(stats_path), "/sys/class/tvm-vta/%s/stats", basename(name));
+    free(name);
+
+    fd = open(device, O_RDWR);
+    if (fd < 0){
+        fprintf(stderr,"open: %s\n", strerror(errno));
+        return -1;
+    }
+    char *dram = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (dram == MAP_FAILED) {
+        fprintf(stderr, "error in mmap\n");
+        close(fd);
+        return -1;
+    }
+    if (ioctl(fd, IOCTL_TVM_VTA_CMD_REGISTER_PROGRAM, &prog) < 0) {
+        fprintf(stderr,"register program: %s\n", strerror(errno));
+        return -1;
+    }
+    host_in = malloc(in_size);
+    host_out = malloc(out_size);
+    if (!host_in || !host_out) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    memset(host_in, 0x5a, in_size);
+
+    busy = busy_ns();
+    t = now_s();
+    if (run_serial(fd, dram, prog.handle, iterations) < 0)
+        return -1;
+    t = now_s() - t;
+    report("serial", t, busy != NO_STATS ? busy_ns() - busy : NO_STATS, iterations);
+
+    busy = busy_ns();
+    t = now_s();
+    if (run_pipelined(fd, dram, prog.handle, iterations) < 0)
+        return -1;
+    t = now_s() - t;
+    report("pipelined", t, busy != NO_STATS ? busy_ns() - busy : NO_STATS, iterations);
+
+    free(host_in);
+    free(host_out);
+    munmap(dram, MAP_SIZE);
+    close(fd);
+    return 0;
+}
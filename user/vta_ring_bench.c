@@ -0,0 +1,172 @@
+/*
+ * Compare per-ioctl exec against command ring submission.
+ *
+ *     $ gcc -O2 -o vta_ring_bench vta_ring_bench.c
+ *     $ ./vta_ring_bench -n 10000 -b 32 -c 16
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../driver/vta_ioctl.h"
+
+#define DEV_NAME "/dev/tvm-vta-0"
+#define MAP_SIZE (4096 * 1024)
+#define RING_OFFSET (MAP_SIZE - 4096 * 16)
+
+static void print_usage(const char *prog)
+{
+    fprintf(stdout,"Usage: %s [-hdnbac]\n",prog);
+    fprintf(stdout,"\t-d --device\t\t\t\t: device to use.\n");
+    fprintf(stdout,"\t-n --iterations\t\t\t\t: number of execs per mode.\n");
+    fprintf(stdout,"\t-b --batch\t\t\t\t: ring entries queued per kick.\n");
+    fprintf(stdout,"\t-a --addr\t\t\t\t: instruction address in the slice.\n");
+    fprintf(stdout,"\t-c --count\t\t\t\t: instructions per exec.\n");
+    fprintf(stdout,"\t-h --help\t\t\t\t: print this message\n");
+    return;
+}
+
+static const struct option lopts[] = {
+    { "device", required_argument, 0, 'd' },
+    { "iterations", required_argument, 0, 'n' },
+    { "batch", required_argument, 0, 'b' },
+    { "addr", required_argument, 0, 'a' },
+    { "count", required_argument, 0, 'c' },
+    { "help", no_argument, 0, 'h' },
+    { 0, 0, 0, 0 },
+};
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double bench_ioctl(int fd, vta_exec_t *exec, int iterations)
+{
+    double start = now_us();
+    for (int i = 0; i < iterations; i++) {
+        if (ioctl(fd, IOCTL_TVM_VTA_CMD_EXEC, exec) < 0) {
+            fprintf(stderr,"exec: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return now_us() - start;
+}
+
+static double bench_ring(int fd, volatile vta_ring_t *ring, unsigned entries,
+                         vta_exec_t *exec, int iterations, int batch)
+{
+    unsigned tail = 0;
+    __u64 seq;
+    vta_wait_t wait;
+    double start = now_us();
+
+    for (int done = 0; done < iterations; done += batch) {
+        int n = iterations - done < batch ? iterations - done : batch;
+        for (int i = 0; i < n; i++) {
+            volatile vta_exec_t *e = &ring->entries[(tail + i) & (entries - 1)];
+            e->insn_phy_addr = exec->insn_phy_addr;
+            e->insn_count = exec->insn_count;
+            e->wait_cycles = exec->wait_cycles;
+            e->status = 0;
+        }
+        tail += n;
+        __sync_synchronize();
+        ring->tail = tail;
+        if (ioctl(fd, IOCTL_TVM_VTA_CMD_RING_KICK, &seq) < 0) {
+            fprintf(stderr,"kick: %s\n", strerror(errno));
+            return -1;
+        }
+        memset(&wait, 0, sizeof(wait));
+        wait.seq = seq;
+        wait.timeout_ns = -1;
+        if (ioctl(fd, IOCTL_TVM_VTA_CMD_WAIT, &wait) < 0) {
+            fprintf(stderr,"wait: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return now_us() - start;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* device = DEV_NAME;
+    int iterations = 10000;
+    int batch = 32;
+    unsigned entries = 64;
+    vta_exec_t exec;
+    vta_ring_setup_t setup;
+    int option_index = 0;
+    int c, fd;
+    double t_ioctl, t_ring;
+
+    memset(&exec, 0, sizeof(exec));
+    exec.insn_count = 16;
+
+    while ((c = getopt_long(argc, argv, "hd:n:b:a:c:", lopts, &option_index)) != -1) {
+        switch (c) {
+            case 'd': device = optarg; break;
+            case 'n': iterations = atoi(optarg); break;
+            case 'b': batch = atoi(optarg); break;
+            case 'a': exec.insn_phy_addr = strtoul(optarg, NULL, 0); break;
+            case 'c': exec.insn_count = strtoul(optarg, NULL, 0); break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    if (iterations <= 0 || batch <= 0)
+        batch = iterations = 1;
+    while (entries < (unsigned)batch)
+        entries <<= 1;
+    if (entries > VTA_RING_MAX_ENTRIES) {
+        fprintf(stderr,"batch too large\n");
+        return -1;
+    }
+
+    fd = open(device, O_RDWR);
+    if (fd < 0){
+        fprintf(stderr,"open: %s\n", strerror(errno));
+        return -1;
+    }
+
+    char* address = mmap (NULL, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        fprintf(stderr, "error in mmap\n");
+        close(fd);
+        return -1;
+    }
+
+    setup.offset = RING_OFFSET;
+    setup.entries = entries;
+    if (ioctl(fd, IOCTL_TVM_VTA_CMD_RING_SETUP, &setup) < 0) {
+        fprintf(stderr,"ring setup: %s\n", strerror(errno));
+        return -1;
+    }
+
+    t_ioctl = bench_ioctl(fd, &exec, iterations);
+    t_ring = bench_ring(fd, (volatile vta_ring_t *)(address + RING_OFFSET), entries,
+                        &exec, iterations, batch);
+    if (t_ioctl < 0 || t_ring < 0)
+        return -1;
+
+    fprintf(stdout,"insn_count %u, %d execs\n", exec.insn_count, iterations);
+    fprintf(stdout,"ioctl: %10.2f us total %8.3f us/exec\n", t_ioctl, t_ioctl / iterations);
+    fprintf(stdout,"ring : %10.2f us total %8.3f us/exec (batch %d)\n",
+            t_ring, t_ring / iterations, batch);
+
+    munmap(address, MAP_SIZE);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Read the exec trace ring of a device and print per-stage latency
+ * percentiles. Load the driver with trace_entries=N to enable the ring.
+ *
+ *     $ gcc -O2 -o vta_trace vta_trace.c
+ *     $ ./vta_trace -t 10
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../driver/vta_ioctl.h"
+
+#define DEV_NAME "/dev/tvm-vta-0"
+
+enum { STAGE_COPY, STAGE_SUBMIT, STAGE_EXEC, STAGE_WAKE, STAGE_TOTAL, NR_STAGES };
+
+static const char *stage_names[NR_STAGES] = {
+    "copy", "submit", "exec", "wake", "total",
+};
+
+static void print_usage(const char *prog)
+{
+    fprintf(stdout,"Usage: %s [-hdti]\n",prog);
+    fprintf(stdout,"\t-d --device\t\t\t\t: device to use.\n");
+    fprintf(stdout,"\t-t --time\t\t\t\t: seconds to collect, 0 reads what is in the ring.\n");
+    fprintf(stdout,"\t-i --interval\t\t\t\t: poll interval in ms.\n");
+    fprintf(stdout,"\t-h --help\t\t\t\t: print this message\n");
+    return;
+}
+
+static const struct option lopts[] = {
+    { "device", required_argument, 0, 'd' },
+    { "time", required_argument, 0, 't' },
+    { "interval", required_argument, 0, 'i' },
+    { "help", no_argument, 0, 'h' },
+    { 0, 0, 0, 0 },
+};
+
+static uint64_t *samples[NR_STAGES];
+static size_t nr_samples, cap_samples;
+static uint64_t lost;
+
+static void add_record(const vta_trace_rec_t *rec)
+{
+    if (nr_samples == cap_samples) {
+        cap_samples = cap_samples ? cap_samples * 2 : 4096;
+        for (int s = 0; s < NR_STAGES; s++) {
+            samples[s] = realloc(samples[s], cap_samples * sizeof(uint64_t));
+            if (!samples[s]) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+    }
+    samples[STAGE_COPY][nr_samples] = rec->t_copied - rec->t_enter;
+    samples[STAGE_SUBMIT][nr_samples] = rec->t_start - rec->t_copied;
+    samples[STAGE_EXEC][nr_samples] = rec->t_done - rec->t_start;
+    samples[STAGE_WAKE][nr_samples] = rec->t_return - rec->t_done;
+    samples[STAGE_TOTAL][nr_samples] = rec->t_return - rec->t_enter;
+    nr_samples++;
+}
+
+/* Consume records [*tail, head). Records already overwritten or still
+ * being written are counted as lost. */
+static void drain(volatile vta_trace_t *trace, uint64_t *tail)
+{
+    uint64_t head = trace->head;
+    uint32_t entries = trace->entries;
+    vta_trace_rec_t rec;
+
+    if (head > *tail + entries) {
+        lost += head - entries - *tail;
+        *tail = head - entries;
+    }
+    for (; *tail < head; (*tail)++) {
+        volatile vta_trace_rec_t *src = &trace->records[*tail & (entries - 1)];
+        if (src->seq != *tail + 1) {
+            lost++;
+            continue;
+        }
+        __sync_synchronize();
+        memcpy(&rec, (const void *)src, sizeof(rec));
+        __sync_synchronize();
+        if (src->seq != *tail + 1) {
+            lost++;
+            continue;
+        }
+        add_record(&rec);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *v, size_t n, double p)
+{
+    size_t i = (size_t)(p * (n - 1) + 0.5);
+    return v[i] / 1e3;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* device = DEV_NAME;
+    int seconds = 0, interval_ms = 10;
+    int option_index = 0;
+    int c, fd;
+    uint64_t tail = 0;
+
+    while ((c = getopt_long(argc, argv, "hd:t:i:", lopts, &option_index)) != -1) {
+        switch (c) {
+            case 'd': device = optarg; break;
+            case 't': seconds = atoi(optarg); break;
+            case 'i': interval_ms = atoi(optarg); break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    fd = open(device, O_RDONLY);
+    if (fd < 0){
+        fprintf(stderr,"open: %s\n", strerror(errno));
+        return -1;
+    }
+    /* The header tells the ring size, map it first to learn the rest. */
+    long page = sysconf(_SC_PAGESIZE);
+    volatile vta_trace_t *trace = mmap(NULL, page, PROT_READ, MAP_SHARED, fd,
+                                       VTA_MMAP_TRACE_OFFSET);
+    if (trace == MAP_FAILED) {
+        fprintf(stderr, "mmap trace: %s (loaded with trace_entries?)\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    size_t size = sizeof(vta_trace_t) + (size_t)trace->entries * sizeof(vta_trace_rec_t);
+    size = (size + page - 1) & ~(page - 1);
+    munmap((void *)trace, page);
+    trace = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, VTA_MMAP_TRACE_OFFSET);
+    if (trace == MAP_FAILED) {
+        fprintf(stderr, "mmap trace: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (seconds > 0) {
+        /* Only what happens from now on. */
+        tail = trace->head;
+        struct timespec ts = { interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+        time_t end = time(NULL) + seconds;
+        while (time(NULL) < end) {
+            nanosleep(&ts, NULL);
+            drain(trace, &tail);
+        }
+    } else {
+        drain(trace, &tail);
+    }
+
+    fprintf(stdout,"%zu execs, %llu lost\n", nr_samples, (unsigned long long)lost);
+    if (nr_samples) {
+        fprintf(stdout,"%-8s %12s %12s %12s %12s\n", "stage", "p50 us", "p99 us", "p999 us", "max us");
+        for (int s = 0; s < NR_STAGES; s++) {
+            qsort(samples[s], nr_samples, sizeof(uint64_t), cmp_u64);
+            fprintf(stdout,"%-8s %12.2f %12.2f %12.2f %12.2f\n", stage_names[s],
+                    percentile(samples[s], nr_samples, 0.5),
+                    percentile(samples[s], nr_samples, 0.99),
+                    percentile(samples[s], nr_samples, 0.999),
+                    samples[s][nr_samples - 1] / 1e3);
+        }
+    }
+
+    munmap((void *)trace, size);
+    close(fd);
+    return 0;
+}